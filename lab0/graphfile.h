@@ -0,0 +1,67 @@
+#ifndef GRAPHFILE_H
+#define GRAPHFILE_H
+
+/* a precompiled graph which preflow can map and use without parsing.
+ * text2bin makes one from the usual "n m C P" text input.
+ *
+ * the file is a graphfile_t followed by two arrays:
+ *
+ *	int32_t		first[n + 1]	arcs of node u are first[u] to
+ *					first[u + 1] - 1.
+ *	graphfile_arc_t	arc[2 * m]	one arc per edge endpoint.
+ *
+ * an edge (u, v, c) of the input becomes one arc from u to v and one
+ * from v to u, both with capacity c, and rev of each is the index of
+ * the other. preflow uses c as the residual capacity of the arc and
+ * changes it in a private mapping of the file.
+ *
+ * numbers are stored in the byte order of the machine that wrote the
+ * file, so that a little-endian file is rejected by the magic check on
+ * a big-endian machine.
+ *
+ * bump GRAPHFILE_VERSION whenever the layout changes.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRAPHFILE_MAGIC		0x47465050	/* "PPFG" little-endian.	*/
+#define GRAPHFILE_VERSION	1
+
+typedef struct graphfile_t	graphfile_t;
+typedef struct graphfile_arc_t	graphfile_arc_t;
+
+struct graphfile_t {
+	uint32_t	magic;	/* GRAPHFILE_MAGIC.		*/
+	int32_t		version;/* GRAPHFILE_VERSION.		*/
+	int32_t		n;	/* nodes.			*/
+	int32_t		m;	/* edges.			*/
+	int32_t		s;	/* source.			*/
+	int32_t		t;	/* sink.			*/
+};
+
+struct graphfile_arc_t {
+	int32_t		v;	/* the node the arc goes to.	*/
+	int32_t		rev;	/* index of the reverse arc.	*/
+	int32_t		c;	/* capacity.			*/
+};
+
+static inline size_t graphfile_size(int n, int m)
+{
+	return sizeof(graphfile_t)
+		+ (size_t) (n + 1) * sizeof(int32_t)
+		+ (size_t) 2 * m * sizeof(graphfile_arc_t);
+}
+
+static inline int32_t* graphfile_first(graphfile_t* h)
+{
+	return (int32_t*) (h + 1);
+}
+
+static inline graphfile_arc_t* graphfile_arc(graphfile_t* h)
+{
+	return (graphfile_arc_t*) (graphfile_first(h) + h->n + 1);
+}
+
+#endif /* GRAPHFILE_H */
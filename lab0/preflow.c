@@ -1,8 +1,11 @@
 /* This is an implementation of the preflow-push algorithm, by
  * Goldberg and Tarjan, for the 2021 EDAN26 Multicore programming labs.
  *
- * It is intended to be as simple as possible to understand and is
- * not optimized in any way.
+ * It was first written to be as simple as possible to understand and
+ * has since been optimized: the input is mapped and scanned without
+ * stdio or read from a binary graph file, the arcs are stored in CSR
+ * form, and the solver selects nodes with a choice of rules and uses
+ * current arcs, global relabeling and the gap heuristic.
  *
  * You should NOT read everything for this course.
  *
@@ -29,10 +32,18 @@
  
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graphfile.h"
+#include "input.h"
 
 #define PRINT		0	/* enable/disable prints. */
 
@@ -51,6 +62,7 @@
 #endif
 
 #define MIN(a,b)	(((a)<=(b))?(a):(b))
+#define MAX(a,b)	(((a)>=(b))?(a):(b))
 
 /* introduce names for some structs. a struct is like a class, except
  * it cannot be extended and has no member methods, and everything is
@@ -63,25 +75,27 @@
 
 typedef struct graph_t	graph_t;
 typedef struct node_t	node_t;
-typedef struct edge_t	edge_t;
-typedef struct list_t	list_t;
-
-struct list_t {
-	edge_t*		edge;
-	list_t*		next;
-};
+typedef struct arc_t	arc_t;
+typedef struct cut_t	cut_t;
 
 struct node_t {
 	int		h;	/* height.			*/
 	int		e;	/* excess flow.			*/
-	list_t*		edge;	/* adjacency list.		*/
 	node_t*		next;	/* with excess preflow.		*/
+	int		cur;	/* current arc.			*/
+	node_t*		after;	/* at the same height below n.	*/
+	node_t*		before;	/* ditto, see enter_layer.	*/
 };
 
-struct edge_t {
-	node_t*		u;	/* one of the two nodes.	*/
-	node_t*		v;	/* the other. 			*/
-	int		f;	/* flow > 0 if from u to v.	*/
+struct arc_t {
+	int		v;	/* the node the arc goes to.	*/
+	int		rev;	/* index of the reverse arc.	*/
+	int		r;	/* residual capacity.		*/
+};
+
+struct cut_t {
+	int		u;	/* on the source side.		*/
+	int		v;	/* on the sink side.		*/
 	int		c;	/* capacity.			*/
 };
 
@@ -89,17 +103,67 @@ struct graph_t {
 	int		n;	/* nodes.			*/
 	int		m;	/* edges.			*/
 	node_t*		v;	/* array of n nodes.		*/
-	edge_t*		e;	/* array of m edges.		*/
+	int*		first;	/* arcs of v[i] start at first[i].	*/
+	arc_t*		arc;	/* array of 2m arcs.		*/
 	node_t*		s;	/* source.			*/
 	node_t*		t;	/* sink.			*/
 	node_t*		excess;	/* nodes with e > 0 except s,t.	*/
+	int		select;	/* which node with excess next.	*/
+	node_t**	bucket;	/* excess nodes by height.	*/
+	int		maxh;	/* no excess node above maxh.	*/
+	int		minh;	/* or below minh.		*/
+	int		delta;	/* excess limit when scaling.	*/
+	int		least;	/* excess to be in the set.	*/
+	int*		ring;	/* excess nodes in FIFO order.	*/
+	int		head;	/* ring[head] is taken next.	*/
+	int		count;	/* nodes in ring.		*/
+	int*		queue;	/* for global_relabel.		*/
+	node_t**	layer;	/* nodes with height h < n.	*/
+	int		top;	/* no layer above top has nodes.	*/
+	long		work;	/* since the last global_relabel.	*/
+	long		limit;	/* work before global_relabel.	*/
+	int		phase;	/* 1 or 2, see preflow.		*/
+	int*		orig;	/* input number of v[i] or NULL.	*/
+	input_t		file;	/* graph file with first and arc.	*/
+};
+
+enum {
+	ORDER_NONE,		/* keep the input numbers.	*/
+	ORDER_BFS,		/* see renumber.		*/
+	ORDER_RCM,
+	ORDER_DEGREE,
 };
 
+enum {
+	SELECT_LIFO,		/* see enter_excess.		*/
+	SELECT_HIGHEST,
+	SELECT_FIFO,
+	SELECT_SCALING,
+};
+
+/* the adjacency of all nodes is stored in compressed sparse row (CSR)
+ * form: the arcs leaving v[i] are arc[first[i]] to arc[first[i+1] - 1],
+ * so first has n + 1 elements. each edge (u, v, c) of the input gives
+ * two arcs, one from u to v and one from v to u, which know each other
+ * through rev.
+ *
+ * instead of a flow and a capacity, an arc only has its residual
+ * capacity r, i.e. how much more we may push along it. both arcs start
+ * with r = c, and pushing d from u to v takes d from the r of the arc
+ * from u and gives d to the r of the arc from v. the flow from u to v is
+ * c - r of the arc from u, but we never need it to find the max flow.
+ *
+ * this way the arcs of a node are next to each other in memory and
+ * there are no lists to follow, and we never need to check which
+ * direction an edge is used in.
+ *
+ */
+
 /* a remark about C arrays. the phrase above 'array of n nodes' is using
  * the word 'array' in a general sense for any language. in C an array
  * (i.e., the technical term array in ISO C) is declared as: int x[10],
  * i.e., with [size] but for convenience most people refer to the data
- * in memory as an array here despite the graph_t's v and e members 
+ * in memory as an array here despite the graph_t's v and arc members
  * are not strictly arrays. they are pointers. once we have allocated
  * memory for the data in the ''array'' for the pointer, the syntax of
  * using an array or pointer is the same so we can refer to a node with
@@ -108,7 +172,7 @@ struct graph_t {
  *
  * where the -> is identical to Java's . in this expression.
  * 
- * in summary: just use the v and e as arrays.
+ * in summary: just use the v and arc as arrays.
  * 
  * a difference between C and Java is that in Java you can really not
  * have an array of nodes as we do. instead you need to have an array
@@ -120,8 +184,6 @@ struct graph_t {
 
 static char* progname;
 
-#if PRINT
-
 static int id(graph_t* g, node_t* v)
 {
 	/* return the node index for v.
@@ -146,7 +208,6 @@ static int id(graph_t* g, node_t* v)
 
 	return v - g->v;
 }
-#endif
 
 void error(const char* fmt, ...)
 {
@@ -190,32 +251,6 @@ void error(const char* fmt, ...)
 	exit(1);
 }
 
-static int next_int()
-{
-        int     x;
-        int     c;
-
-	/* this is like Java's nextInt to get the next integer.
-	 *
-	 * we read the next integer one digit at a time which is
-	 * simpler and faster than using the normal function
-	 * fscanf that needs to do more work.
-	 *
-	 * we get the value of a digit character by subtracting '0'
-	 * so the character '4' gives '4' - '0' == 4
-	 *
-	 * it works like this: say the next input is 124
-	 * x is first 0, then 1, then 10 + 2, and then 120 + 4.
-	 *
-	 */
-
-	x = 0;
-        while (isdigit(c = getchar()))
-                x = 10 * x + c - '0';
-
-        return x;
-}
-
 static void* xmalloc(size_t s)
 {
 	void*		p;
@@ -265,68 +300,461 @@ static void* xcalloc(size_t n, size_t s)
 	return p;
 }
 
-static void add_edge(node_t* u, edge_t* e)
+static graph_t* new_graph(FILE* in, int n, int m)
 {
-	list_t*		p;
+	graph_t*	g;
+	arc_t*		arc;
+	int*		next;
+	int*		a;
+	int*		b;
+	int*		c;
+	int		i;
+	int		j;
+	int		k;
+	
+	g = xmalloc(sizeof(graph_t));
 
-	/* allocate memory for a list link and put it first
-	 * in the adjacency list of u.
+	g->n = n;
+	g->m = m;
+	
+	g->v = xcalloc(n, sizeof(node_t));
+	g->first = xcalloc(n + 1, sizeof(int));
+	g->arc = xmalloc(2 * (size_t) m * sizeof(arc_t));
+	memset(&g->file, 0, sizeof g->file);
+
+	g->s = &g->v[0];
+	g->t = &g->v[n-1];
+	g->excess = NULL;
+	g->select = SELECT_LIFO;
+	g->bucket = NULL;
+	g->ring = NULL;
+	g->queue = NULL;
+	g->layer = NULL;
+	g->orig = NULL;
+
+	/* we need to know how many arcs each node has before we can
+	 * put them in place so we first read all edges.
+	 *
+	 */
+
+	a = xmalloc(m * sizeof(int));
+	b = xmalloc(m * sizeof(int));
+	c = xmalloc(m * sizeof(int));
+
+	for (i = 0; i < m; i += 1) {
+		a[i] = next_int();
+		b[i] = next_int();
+		c[i] = next_int();
+		g->first[a[i] + 1] += 1;
+		g->first[b[i] + 1] += 1;
+	}
+
+	/* now first[i + 1] is the number of arcs of node i. we add
+	 * them up so that first[i] is the sum of all arcs of the nodes
+	 * before i, which is where the arcs of i should go.
 	 *
 	 */
 
-	p = xmalloc(sizeof(list_t));
-	p->edge = e;
-	p->next = u->edge;
-	u->edge = p;
+	for (i = 0; i < n; i += 1)
+		g->first[i + 1] += g->first[i];
+
+	next = xmalloc(n * sizeof(int));
+	memcpy(next, g->first, n * sizeof(int));
+	arc = g->arc;
+
+	for (i = 0; i < m; i += 1) {
+		j = next[a[i]]++;
+		k = next[b[i]]++;
+		arc[j].v = b[i];
+		arc[j].rev = k;
+		arc[j].r = c[i];
+		arc[k].v = a[i];
+		arc[k].rev = j;
+		arc[k].r = c[i];
+	}
+
+	free(next);
+	free(a);
+	free(b);
+	free(c);
+
+	return g;
 }
 
-static void connect(node_t* u, node_t* v, int c, edge_t* e)
+#if MMAP_INPUT
+static int is_graphfile(input_t* in)
 {
-	/* connect two nodes by putting a shared (same object)
-	 * in their adjacency lists.
+	graphfile_t*	h;
+
+	if ((size_t) (in->end - in->buf) < sizeof(graphfile_t))
+		return 0;
+
+	h = (graphfile_t*) in->buf;
+
+	return h->magic == GRAPHFILE_MAGIC;
+}
+
+static void check_graphfile(graphfile_t* h, size_t size)
+{
+	int32_t*	first;
+	graphfile_arc_t* arc;
+	int		u;
+	int		j;
+	int		r;
+
+	/* we use the file in place so a truncated or corrupt file
+	 * would make us read and write outside of it. one pass over
+	 * the arrays is much less work than parsing text, and after
+	 * it every index we will follow is known to be in range.
 	 *
 	 */
 
-	e->u = u;
-	e->v = v;
-	e->c = c;
+	if (h->n < 1 || h->m < 0 || h->m > INT_MAX / 2 - 1)
+		error("graph file has %d nodes and %d edges", h->n, h->m);
+
+	if (size != graphfile_size(h->n, h->m))
+		error("graph file has %zu bytes but should have %zu",
+			size, graphfile_size(h->n, h->m));
+
+	if (h->s < 0 || h->s >= h->n || h->t < 0 || h->t >= h->n)
+		error("graph file source %d or sink %d is not a node", h->s, h->t);
+
+	first = graphfile_first(h);
+	arc = graphfile_arc(h);
 
-	add_edge(u, e);
-	add_edge(v, e);
+	if (first[0] != 0 || first[h->n] != 2 * h->m)
+		error("graph file arcs begin at %d and end at %d, not 0 and %d",
+			first[0], first[h->n], 2 * h->m);
+
+	for (u = 0; u < h->n; u += 1)
+		if (first[u] > first[u + 1])
+			error("graph file arcs of node %d are out of order", u);
+
+	/* each arc must go to a node and its reverse must be an arc
+	 * back from that node to this one.
+	 *
+	 */
+
+	for (u = 0; u < h->n; u += 1) {
+		for (j = first[u]; j < first[u + 1]; j += 1) {
+			r = arc[j].rev;
+			if (arc[j].v < 0 || arc[j].v >= h->n || arc[j].c < 0
+				|| r < first[arc[j].v] || r >= first[arc[j].v + 1]
+				|| arc[r].rev != j)
+				error("graph file arc %d of node %d is corrupt", j, u);
+		}
+	}
 }
 
-static graph_t* new_graph(FILE* in, int n, int m)
+static graph_t* map_graph(input_t* in)
 {
+	graphfile_t*	h;
 	graph_t*	g;
-	node_t*		u;
-	node_t*		v;
+
+	/* make a graph from a file written by text2bin instead of
+	 * from text. the file has the same first and arc arrays that
+	 * we use (see graphfile.h) so we simply point at them. the
+	 * capacity of an arc in the file is its residual capacity
+	 * before any push.
+	 *
+	 * the graph takes over the input and free_graph unmaps it.
+	 * the mapping is private so our pushes are never written
+	 * back to the file.
+	 *
+	 */
+
+	assert(sizeof(arc_t) == sizeof(graphfile_arc_t));
+
+	h = (graphfile_t*) in->buf;
+
+	if (h->version != GRAPHFILE_VERSION)
+		error("graph file version %d but expected %d", h->version, GRAPHFILE_VERSION);
+
+	check_graphfile(h, in->end - in->buf);
+
+	g = xmalloc(sizeof(graph_t));
+
+	g->n = h->n;
+	g->m = h->m;
+
+	g->v = xcalloc(g->n, sizeof(node_t));
+	g->first = graphfile_first(h);
+	g->arc = (arc_t*) graphfile_arc(h);
+
+	g->s = &g->v[h->s];
+	g->t = &g->v[h->t];
+	g->excess = NULL;
+	g->select = SELECT_LIFO;
+	g->bucket = NULL;
+	g->ring = NULL;
+	g->queue = NULL;
+	g->layer = NULL;
+	g->orig = NULL;
+
+	g->file = *in;
+	memset(in, 0, sizeof(input_t));
+
+	return g;
+}
+#endif
+
+static int cmp_key(const void* a, const void* b)
+{
+	long long	x = *(const long long*) a;
+	long long	y = *(const long long*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void by_degree(graph_t* g, int* nodes, int k, int decreasing)
+{
+	long long*	key;
+	int		d;
+	int		i;
+
+	/* sort the k nodes in nodes by their number of arcs. for the
+	 * curious: we put the degree in the upper 32 bits and the node
+	 * in the lower, so a plain sort of the numbers sorts by degree
+	 * and then by node.
+	 *
+	 */
+
+	key = xmalloc((k + 1) * sizeof(long long));
+
+	for (i = 0; i < k; i += 1) {
+		d = g->first[nodes[i] + 1] - g->first[nodes[i]];
+		if (decreasing)
+			d = INT32_MAX - d;
+		key[i] = (long long) d << 32 | nodes[i];
+	}
+
+	qsort(key, k, sizeof(long long), cmp_key);
+
+	for (i = 0; i < k; i += 1)
+		nodes[i] = key[i] & 0xffffffff;
+
+	free(key);
+}
+
+static int* breadth_first(graph_t* g, int* roots, int sort)
+{
+	int*		order;
+	char*		seen;
+	int		head;
+	int		tail;
+	int		tail0;
 	int		i;
+	int		u;
+	int		w;
 	int		a;
-	int		b;
-	int		c;
-	
-	g = xmalloc(sizeof(graph_t));
 
-	g->n = n;
-	g->m = m;
-	
-	g->v = xcalloc(n, sizeof(node_t));
-	g->e = xcalloc(m, sizeof(edge_t));
+	/* visit all nodes breadth first, i.e. first root then all its
+	 * neighbours, then all their neighbours, and so on. when no
+	 * more can be reached we continue from the next root that has
+	 * not been seen. with sort the new neighbours of each node are
+	 * visited in order of degree, which is Cuthill-McKee.
+	 *
+	 * order[k] is the node visited as number k.
+	 *
+	 */
 
-	g->s = &g->v[0];
-	g->t = &g->v[n-1];
+	order = xmalloc(g->n * sizeof(int));
+	seen = xcalloc(g->n, sizeof(char));
+	tail = 0;
+
+	for (i = 0; i < g->n; i += 1) {
+		if (seen[roots[i]])
+			continue;
+
+		head = tail;
+		order[tail++] = roots[i];
+		seen[roots[i]] = 1;
+
+		while (head < tail) {
+			u = order[head++];
+			tail0 = tail;
+
+			for (a = g->first[u]; a < g->first[u+1]; a += 1) {
+				w = g->arc[a].v;
+				if (!seen[w]) {
+					seen[w] = 1;
+					order[tail++] = w;
+				}
+			}
+
+			if (sort && tail - tail0 > 1)
+				by_degree(g, order + tail0, tail - tail0, 0);
+		}
+	}
+
+	free(seen);
+
+	return order;
+}
+
+static void renumber(graph_t* g, int how)
+{
+	int*		order;
+	int*		roots;
+	int*		new;
+	int*		first;
+	arc_t*		arc;
+	arc_t*		a;
+	int		n;
+	int		i;
+	int		j;
+	int		k;
+	int		u;
+	int		w;
+
+	/* give the nodes new numbers so that nodes that are near each
+	 * other in the graph also are near each other in g->v and g->arc.
+	 * then a push or a look at the height of a neighbour is more
+	 * likely to use a cache block we already have.
+	 *
+	 *	ORDER_BFS	breadth first from the source.
+	 *	ORDER_RCM	reverse Cuthill-McKee from a node with
+	 *			fewest arcs.
+	 *	ORDER_DEGREE	most arcs first.
+	 *
+	 * node k in the new graph was node order[k], which we keep in
+	 * g->orig so that results can be given with the input numbers.
+	 *
+	 */
+
+	n = g->n;
+	roots = xmalloc(n * sizeof(int));
+
+	for (i = 0; i < n; i += 1)
+		roots[i] = i;
+
+	switch (how) {
+	case ORDER_BFS:
+		roots[0] = id(g, g->s);
+		roots[id(g, g->s)] = 0;
+		order = breadth_first(g, roots, 0);
+		break;
+
+	case ORDER_RCM:
+		by_degree(g, roots, n, 0);
+		order = breadth_first(g, roots, 1);
+		for (i = 0, j = n - 1; i < j; i += 1, j -= 1) {
+			k = order[i];
+			order[i] = order[j];
+			order[j] = k;
+		}
+		break;
+
+	case ORDER_DEGREE:
+		order = xmalloc(n * sizeof(int));
+		memcpy(order, roots, n * sizeof(int));
+		by_degree(g, order, n, 1);
+		break;
+
+	default:
+		free(roots);
+		return;
+	}
+
+	free(roots);
+
+	new = xmalloc(n * sizeof(int));
+	for (k = 0; k < n; k += 1)
+		new[order[k]] = k;
+
+	/* copy the arcs of each node to where they go with the new
+	 * numbers. an arc that was number j of old node u is number
+	 * j - g->first[u] of new node new[u], and the same for rev.
+	 *
+	 */
+
+	first = xmalloc((n + 1) * sizeof(int));
+	arc = xmalloc(2 * (size_t) g->m * sizeof(arc_t));
+
+	first[0] = 0;
+	for (k = 0; k < n; k += 1) {
+		u = order[k];
+		first[k + 1] = first[k] + g->first[u + 1] - g->first[u];
+	}
+
+	for (k = 0; k < n; k += 1) {
+		u = order[k];
+		for (j = g->first[u]; j < g->first[u + 1]; j += 1) {
+			a = &arc[first[k] + j - g->first[u]];
+			w = g->arc[j].v;
+			a->v = new[w];
+			a->rev = first[new[w]] + g->arc[j].rev - g->first[w];
+			a->r = g->arc[j].r;
+		}
+	}
+
+	g->s = &g->v[new[id(g, g->s)]];
+	g->t = &g->v[new[id(g, g->t)]];
+
+	free(new);
+
+#if MMAP_INPUT
+	if (g->file.buf != NULL)
+		close_input(&g->file);
+	else
+#endif
+	{
+		free(g->first);
+		free(g->arc);
+	}
+
+	g->first = first;
+	g->arc = arc;
+	g->orig = order;
+}
+
+static void init_excess(graph_t* g, int select)
+{
+	/* the set of nodes with excess preflow can be kept in
+	 * different ways, which decides which node we take next:
+	 *
+	 *	SELECT_LIFO	a list where the last node put in
+	 *			is taken first.
+	 *	SELECT_HIGHEST	one list per height, bucket[h], and
+	 *			we take a node from the highest
+	 *			nonempty list. this usually needs far
+	 *			fewer pushes and relabels since the
+	 *			excess flows down towards t (or back
+	 *			to s) in one sweep.
+	 *	SELECT_FIFO	a queue where the first node put in
+	 *			is taken first. it is a ring of n
+	 *			node numbers since no node is in the
+	 *			set twice.
+	 *	SELECT_SCALING	the lists of SELECT_HIGHEST but we
+	 *			take a node from the lowest nonempty
+	 *			list, and only nodes with at least
+	 *			least excess are in the set (see
+	 *			preflow).
+	 *
+	 * a node with excess never is higher than 2n - 1, so 2n
+	 * lists are enough.
+	 *
+	 * init_excess is also used to empty the set.
+	 *
+	 */
+
+	g->select = select;
 	g->excess = NULL;
 
-	for (i = 0; i < m; i += 1) {
-		a = next_int();
-		b = next_int();
-		c = next_int();
-		u = &g->v[a];
-		v = &g->v[b];
-		connect(u, v, c, g->e+i);
+	if (select == SELECT_HIGHEST || select == SELECT_SCALING) {
+		if (g->bucket == NULL)
+			g->bucket = xmalloc(2 * g->n * sizeof(node_t*));
+		memset(g->bucket, 0, 2 * g->n * sizeof(node_t*));
+		g->maxh = 0;
+		g->minh = 2 * g->n;
 	}
 
-	return g;
+	if (select == SELECT_FIFO) {
+		if (g->ring == NULL)
+			g->ring = xmalloc(g->n * sizeof(int));
+		g->head = 0;
+		g->count = 0;
+	}
 }
 
 static void enter_excess(graph_t* g, node_t* v)
@@ -340,7 +768,28 @@ static void enter_excess(graph_t* g, node_t* v)
 	 *
 	 */
 
-	if (v != g->t && v != g->s) {
+	if (v == g->t || v == g->s)
+		return;
+
+	if (g->phase == 1 && v->h >= g->n)
+		return;
+
+	if (v->e < g->least)
+		return;
+
+	if (g->select == SELECT_HIGHEST || g->select == SELECT_SCALING) {
+		assert(v->h < 2 * g->n);
+		v->next = g->bucket[v->h];
+		g->bucket[v->h] = v;
+		if (v->h > g->maxh)
+			g->maxh = v->h;
+		if (v->h < g->minh)
+			g->minh = v->h;
+	} else if (g->select == SELECT_FIFO) {
+		assert(g->count < g->n);
+		g->ring[(g->head + g->count) % g->n] = id(g, v);
+		g->count += 1;
+	} else {
 		v->next = g->excess;
 		g->excess = v;
 	}
@@ -353,8 +802,48 @@ static node_t* leave_excess(graph_t* g)
 	/* take any node from the set of nodes with excess preflow
 	 * and for simplicity we always take the first.
 	 *
+	 * with SELECT_HIGHEST we first move maxh down to the highest
+	 * nonempty list. it only moves up in enter_excess so in total
+	 * this is no more work than the relabels.
+	 *
 	 */
 
+	if (g->select == SELECT_HIGHEST) {
+		while (g->maxh > 0 && g->bucket[g->maxh] == NULL)
+			g->maxh -= 1;
+
+		v = g->bucket[g->maxh];
+
+		if (v != NULL)
+			g->bucket[g->maxh] = v->next;
+
+		return v;
+	}
+
+	if (g->select == SELECT_SCALING) {
+		while (g->minh < 2 * g->n && g->bucket[g->minh] == NULL)
+			g->minh += 1;
+
+		if (g->minh == 2 * g->n)
+			return NULL;
+
+		v = g->bucket[g->minh];
+		g->bucket[g->minh] = v->next;
+
+		return v;
+	}
+
+	if (g->select == SELECT_FIFO) {
+		if (g->count == 0)
+			return NULL;
+
+		v = &g->v[g->ring[g->head]];
+		g->head = (g->head + 1) % g->n;
+		g->count -= 1;
+
+		return v;
+	}
+
 	v = g->excess;
 
 	if (v != NULL)
@@ -363,20 +852,23 @@ static node_t* leave_excess(graph_t* g)
 	return v;
 }
 
-static void push(graph_t* g, node_t* u, node_t* v, edge_t* e)
+static void push(graph_t* g, node_t* u, node_t* v, int a)
 {
-	int		d;	/* remaining capacity of the edge. */
+	int		d;	/* remaining capacity of the arc. */
 
 	pr("push from %d to %d: ", id(g, u), id(g, v));
-	pr("f = %d, c = %d, so ", e->f, e->c);
+	pr("r = %d, so ", g->arc[a].r);
 	
-	if (u == e->u) {
-		d = MIN(u->e, e->c - e->f);
-		e->f += d;
-	} else {
-		d = MIN(u->e, e->c + e->f);
-		e->f -= d;
-	}
+	d = MIN(u->e, g->arc[a].r);
+
+	/* when scaling no node but s and t may get more than delta. */
+
+	if (g->delta > 0 && v != g->s && v != g->t)
+		d = MIN(d, g->delta - v->e);
+
+	g->arc[a].r -= d;
+	g->arc[g->arc[a].rev].r += d;
+	g->work += 1;
 
 	pr("pushing %d\n", d);
 
@@ -387,19 +879,17 @@ static void push(graph_t* g, node_t* u, node_t* v, edge_t* e)
 
 	assert(d >= 0);
 	assert(u->e >= 0);
-	assert(abs(e->f) <= e->c);
-
-	if (u->e > 0) {
+	assert(g->arc[a].r >= 0);
 
-		/* still some remaining so let u push more. */
-
-		enter_excess(g, u);
-	}
+	/* u is not in the set of nodes with excess while it pushes
+	 * (see discharge) so we only need to care about v.
+	 *
+	 */
 
-	if (v->e == d) {
+	if (v->e - d < g->least && v->e >= g->least) {
 
-		/* since v has d excess now it had zero before and
-		 * can now push.
+		/* v did not have enough excess to be in the set
+		 * before but now it has.
 		 *
 		 */
 
@@ -407,54 +897,291 @@ static void push(graph_t* g, node_t* u, node_t* v, edge_t* e)
 	}
 }
 
-static void relabel(graph_t* g, node_t* u)
+static void enter_layer(graph_t* g, node_t* v)
 {
-	u->h += 1;
+	/* layer[h] is a doubly linked list of the nodes at height
+	 * h < n, so that a node can leave it when it is relabeled and
+	 * a gap can find the nodes above it without looking at all
+	 * nodes. nodes at n or above are in no layer.
+	 *
+	 */
 
-	pr("relabel %d now h = %d\n", id(g, u), u->h);
+	if (v->h >= g->n)
+		return;
+
+	v->before = NULL;
+	v->after = g->layer[v->h];
+
+	if (v->after != NULL)
+		v->after->before = v;
 
-	enter_excess(g, u);
+	g->layer[v->h] = v;
+	g->top = MAX(g->top, v->h);
 }
 
-static node_t* other(node_t* u, edge_t* e)
+static void leave_layer(graph_t* g, node_t* v)
 {
-	if (u == e->u)
-		return e->v;
+	if (v->h >= g->n)
+		return;
+
+	if (v->before != NULL)
+		v->before->after = v->after;
 	else
-		return e->u;
+		g->layer[v->h] = v->after;
+
+	if (v->after != NULL)
+		v->after->before = v->before;
 }
-	
-static int preflow(graph_t* g)
+
+static void make_layers(graph_t* g)
+{
+	int		i;
+
+	memset(g->layer, 0, g->n * sizeof(node_t*));
+	g->top = 0;
+
+	for (i = 0; i < g->n; i += 1)
+		enter_layer(g, &g->v[i]);
+}
+
+static void gap(graph_t* g, int k)
 {
-	node_t*		s;
-	node_t*		u;
 	node_t*		v;
-	edge_t*		e;
-	list_t*		p;
-	int		b;
+	int		h;
+
+	/* no node has height k < n any more, so from a node above k
+	 * an arc with residual capacity only goes to nodes above k
+	 * (heights go down by at most one along such an arc) and
+	 * none of them can reach t which is at 0. their excess must
+	 * go back to s, and they can go up to n at once instead of
+	 * being relabeled one at a time until they get there.
+	 *
+	 * only the layers from k + 1 to top are visited, so a gap
+	 * costs the nodes it lifts and not all n.
+	 *
+	 */
 
-	s = g->s;
-	s->h = g->n;
+	for (h = k + 1; h <= g->top; h += 1) {
+		for (v = g->layer[h]; v != NULL; v = v->after) {
+			v->h = g->n;
+			v->cur = g->first[id(g, v)];
+		}
+		g->layer[h] = NULL;
+	}
 
-	p = s->edge;
+	g->top = k;
+}
 
-	/* start by pushing as much as possible (limited by
-	 * the edge capacity) from the source to its neighbors.
+static void relabel(graph_t* g, node_t* u)
+{
+	arc_t*		arc;
+	int		a;
+	int		h;
+	int		end;
+
+	/* instead of u->h += 1 we go directly to the lowest height
+	 * from which u can push, i.e. one above its lowest neighbour
+	 * through an arc with residual capacity. since u has excess
+	 * some flow came to u and can go back, so there is one.
 	 *
 	 */
 
-	while (p != NULL) {
-		e = p->edge;
-		p = p->next;
+	arc = g->arc;
+	h = 2 * g->n;
+	end = g->first[id(g, u) + 1];
 
-		s->e += e->c;
-		push(g, s, other(s, e), e);
+	for (a = g->first[id(g, u)]; a < end; a += 1)
+		if (arc[a].r > 0 && g->v[arc[a].v].h < h)
+			h = g->v[arc[a].v].h;
+
+	assert(h < 2 * g->n);
+
+	/* if u was the last node at its height there is a gap and
+	 * u goes up with the nodes above it.
+	 *
+	 */
+
+	leave_layer(g, u);
+
+	if (u->h < g->n && g->layer[u->h] == NULL) {
+		gap(g, u->h);
+		h = MAX(h, g->n - 1);
 	}
-	
-	/* then loop until only s and/or t have excess preflow. */
+
+	u->h = h + 1;
+	enter_layer(g, u);
+	u->cur = g->first[id(g, u)];
+	g->work += end - u->cur + 12;
+
+	pr("relabel %d now h = %d\n", id(g, u), u->h);
+}
+
+static void discharge(graph_t* g, node_t* u)
+{
+	arc_t*		arc;
+	node_t*		v;
+	int		a;
+	int		end;
+
+	/* push from u until it has no excess left or it must be
+	 * relabeled.
+	 *
+	 * u->cur is the first arc that may still be used for a push:
+	 * an arc before it either has no residual capacity or goes to
+	 * a node which is not lower than u, and that stays so until
+	 * u is relabeled, since a push to u needs u to be lower, and
+	 * heights never go down. so we continue where we stopped last
+	 * time instead of from the first arc of u, and only go back
+	 * to the first arc when u is relabeled.
+	 *
+	 */
+
+	arc = g->arc;
+	end = g->first[id(g, u) + 1];
+
+	while (u->e >= g->least) {
+		if (u->cur == end) {
+			relabel(g, u);
+			enter_excess(g, u);
+			return;
+		}
+
+		a = u->cur;
+		v = &g->v[arc[a].v];
+
+		if (u->h > v->h && arc[a].r > 0) {
+			push(g, u, v, a);
+
+			/* when scaling a push can stop at delta with
+			 * capacity left in the arc. then we must not go
+			 * past it, and u waits until v, which is lower,
+			 * has been discharged.
+			 *
+			 */
+
+			if (u->e > 0 && arc[a].r > 0) {
+				enter_excess(g, u);
+				return;
+			}
+		}
+
+		if (u->e > 0)
+			u->cur += 1;
+	}
+}
+
+static int search(graph_t* g, int i, int k, int unseen)
+{
+	node_t*		u;
+	node_t*		w;
+	arc_t*		arc;
+	int		a;
+	int		end;
+
+	/* continue the breadth first search with the nodes in
+	 * queue[i] to queue[k - 1], through arcs to them with
+	 * residual capacity, and give the nodes found the height
+	 * of the node they were found from plus one. return how
+	 * many nodes are in the queue now.
+	 *
+	 */
+
+	arc = g->arc;
+
+	while (i < k) {
+		u = &g->v[g->queue[i++]];
+		end = g->first[id(g, u) + 1];
+
+		for (a = g->first[id(g, u)]; a < end; a += 1) {
+			w = &g->v[arc[a].v];
+			if (w->h == unseen && arc[arc[a].rev].r > 0) {
+				w->h = u->h + 1;
+				g->queue[k++] = arc[a].v;
+			}
+		}
+	}
+
+	return k;
+}
+
+static void global_relabel(graph_t* g)
+{
+	int		unseen;
+	int		i;
+	int		k;
+
+	/* relabel sets the height of one node from its neighbours
+	 * and often many nodes climb one step at a time after each
+	 * other. instead we here give every node its exact distance
+	 * to t, through arcs with residual capacity, with a breadth
+	 * first search backwards from t.
+	 *
+	 * nodes from which t cannot be reached have nothing more to
+	 * give t. their excess must go back to s so they get n plus
+	 * their distance to s with a second search from s. nodes
+	 * found by neither search can never get any excess and are
+	 * put at 2n - 1.
+	 *
+	 * a height never is more than the distance (see relabel) so
+	 * no node goes down. every node starts again from its first
+	 * arc, and the set of nodes with excess is made again since
+	 * with SELECT_HIGHEST it depends on the heights.
+	 *
+	 */
+
+	unseen = 2 * g->n - 1;
+
+	for (i = 0; i < g->n; i += 1) {
+		g->v[i].h = unseen;
+		g->v[i].cur = g->first[i];
+	}
+
+	g->t->h = 0;
+	g->queue[0] = id(g, g->t);
+	g->s->h = g->n;
+	k = search(g, 0, 1, unseen);
+
+	g->queue[k] = id(g, g->s);
+	search(g, k, k + 1, unseen);
+
+	make_layers(g);
+
+	init_excess(g, g->select);
+
+	for (i = 0; i < g->n; i += 1)
+		if (g->v[i].e > 0)
+			enter_excess(g, &g->v[i]);
+
+	g->work = 0;
+}
+
+static void discharge_all(graph_t* g)
+{
+	node_t*		u;
+
+	/* loop until no node in the set has excess preflow. */
 
 	while ((u = leave_excess(g)) != NULL) {
 
+		if (g->limit > 0 && g->work > g->limit) {
+
+			/* u has excess so it is put back by
+			 * global_relabel.
+			 *
+			 */
+
+			global_relabel(g);
+			continue;
+		}
+
+		/* a gap may have lifted u to n after it was put in
+		 * the set, and in phase 1 it must then wait.
+		 *
+		 */
+
+		if (g->phase == 1 && u->h >= g->n)
+			continue;
+
 		/* u is any node with excess preflow. */
 
 		pr("selected u = %d with ", id(g, u));
@@ -463,57 +1190,267 @@ static int preflow(graph_t* g)
 		/* if we can push we must push and only if we could
 		 * not push anything, we are allowed to relabel.
 		 *
-		 * we can push to multiple nodes if we wish but
-		 * here we just push once for simplicity.
+		 * discharge pushes as much as it can and relabels u
+		 * if it must, which puts u back into the set.
 		 *
 		 */
 
-		v = NULL;
-		p = u->edge;
+		discharge(g, u);
+	}
+}
 
-		while (p != NULL) {
-			e = p->edge;
-			p = p->next;
+static int preflow(graph_t* g, int select, double alpha, int phases)
+{
+	node_t*		s;
+	arc_t*		arc;
+	int		a;
+	int		i;
 
-			if (u == e->u) {
-				v = e->v;
-				b = 1;
-			} else {
-				v = e->u;
-				b = -1;
-			}
+	s = g->s;
+	s->h = g->n;
+
+	arc = g->arc;
+
+	init_excess(g, select);
+
+	for (i = 0; i < g->n; i += 1)
+		g->v[i].cur = g->first[i];
+
+	/* the nodes by height, for gap. */
+
+	g->layer = xmalloc(g->n * sizeof(node_t*));
+	make_layers(g);
 
-			if (u->h > v->h && b * e->f < e->c)
-				break;
-			else
-				v = NULL;
+	/* we do a global_relabel when we have done about as much
+	 * work since the last one as a global_relabel needs, where
+	 * a push is one unit and a relabel scans the arcs of the
+	 * node. alpha tunes how often: zero means never and larger
+	 * means less often.
+	 *
+	 */
+
+	g->work = 0;
+	g->limit = alpha > 0 ? alpha * g->n + g->m : 0;
+
+	if (alpha > 0)
+		g->queue = xmalloc(g->n * sizeof(int));
+
+	/* the solve has two phases:
+	 *
+	 * 1. push towards t until every node with excess is at height
+	 *    n or more, i.e. cannot reach t any more. then the excess
+	 *    of t is the maximum flow, and the nodes that cannot reach
+	 *    t are the source side of a minimum cut. this is all we
+	 *    need to print f.
+	 *
+	 * 2. push the excess of those nodes back to s, so that we have
+	 *    a flow and not only a preflow, if phases is 2.
+	 *
+	 * in phase 1 nodes at n or above are not put in the set of
+	 * nodes with excess (see enter_excess), and phase 2 starts by
+	 * putting them there.
+	 *
+	 */
+
+	g->phase = 1;
+	g->delta = 0;
+	g->least = 1;
+
+	/* start by pushing as much as possible (limited by
+	 * the edge capacity) from the source to its neighbors.
+	 *
+	 */
+
+	for (a = g->first[id(g, s)]; a < g->first[id(g, s) + 1]; a += 1) {
+		if (arc[a].r == 0)
+			continue;
+		s->e += arc[a].r;
+		push(g, s, &g->v[arc[a].v], a);
+	}
+
+	if (alpha > 0)
+		global_relabel(g);
+
+	if (select == SELECT_SCALING) {
+
+		/* excess scaling by Ahuja and Orlin: delta starts at
+		 * a power of two at least as large as any capacity
+		 * and excess, and is halved after each round. in a
+		 * round only nodes with at least delta / 2 excess are
+		 * discharged, lowest first, and no push gives a node
+		 * more than delta. so each push moves a lot of flow,
+		 * or saturates the arc, also with large capacities.
+		 *
+		 */
+
+		g->delta = 1;
+		for (a = 0; a < 2 * g->m; a += 1)
+			while (g->delta < arc[a].r && g->delta < INT32_MAX / 2 + 1)
+				g->delta *= 2;
+		for (i = 0; i < g->n; i += 1)
+			while (g->delta < g->v[i].e && g->delta < INT32_MAX / 2 + 1)
+				g->delta *= 2;
+
+		for (; g->delta > 0; g->delta /= 2) {
+			g->least = MAX(g->delta / 2, 1);
+			init_excess(g, select);
+			for (i = 0; i < g->n; i += 1)
+				enter_excess(g, &g->v[i]);
+			discharge_all(g);
 		}
 
-		if (v != NULL)
-			push(g, u, v, e);
-		else
-			relabel(g, u);
+		g->least = 1;
+	} else
+		discharge_all(g);
+
+	if (phases == 2) {
+		g->phase = 2;
+
+		for (i = 0; i < g->n; i += 1)
+			if (g->v[i].e > 0)
+				enter_excess(g, &g->v[i]);
+
+		discharge_all(g);
 	}
 
 	return g->t->e;
 }
 
-static void free_graph(graph_t* g)
+static int min_cut(graph_t* g, char* side, cut_t** cut)
 {
+	arc_t*		arc;
+	int*		queue;
+	int		a;
 	int		i;
-	list_t*		p;
-	list_t*		q;
+	int		k;
+	int		u;
+	int		w;
+
+	/* after preflow (phase 1 is enough) the nodes that cannot
+	 * reach t through arcs with residual capacity are the source
+	 * side of a minimum cut. we find the others with a breadth
+	 * first search backwards from t and set side[i] to 1 for the
+	 * source side and 0 for the sink side.
+	 *
+	 * the edges from the source side to the sink side are the cut
+	 * and their capacities add up to the maximum flow. they are
+	 * put in *cut, which the caller frees, and we return how many
+	 * there are. the capacity of an edge is half the sum of the
+	 * residual capacities of its two arcs since a push moves
+	 * capacity from one to the other.
+	 *
+	 */
 
-	for (i = 0; i < g->n; i += 1) {
-		p = g->v[i].edge;
-		while (p != NULL) {
-			q = p->next;
-			free(p);
-			p = q;
+	arc = g->arc;
+	queue = xmalloc(g->n * sizeof(int));
+	memset(side, 1, g->n);
+
+	side[id(g, g->t)] = 0;
+	queue[0] = id(g, g->t);
+	k = 1;
+
+	for (i = 0; i < k; i += 1) {
+		u = queue[i];
+		for (a = g->first[u]; a < g->first[u + 1]; a += 1) {
+			w = arc[a].v;
+			if (side[w] && arc[arc[a].rev].r > 0) {
+				side[w] = 0;
+				queue[k++] = w;
+			}
+		}
+	}
+
+	free(queue);
+
+	k = 0;
+	for (u = 0; u < g->n; u += 1)
+		for (a = g->first[u]; side[u] && a < g->first[u + 1]; a += 1)
+			k += !side[arc[a].v];
+
+	*cut = xmalloc(k * sizeof(cut_t));
+
+	k = 0;
+	for (u = 0; u < g->n; u += 1) {
+		for (a = g->first[u]; side[u] && a < g->first[u + 1]; a += 1) {
+			if (!side[arc[a].v]) {
+				(*cut)[k].u = u;
+				(*cut)[k].v = arc[a].v;
+				(*cut)[k].c = (arc[a].r + arc[arc[a].rev].r) / 2;
+				k += 1;
+			}
 		}
 	}
+
+	return k;
+}
+
+static void print_cut(graph_t* g, int f)
+{
+	cut_t*		cut;
+	char*		side;
+	int*		orig;
+	int		sum;
+	int		i;
+	int		k;
+
+	/* print the source side and the edges of a minimum cut with
+	 * the node numbers of the input:
+	 *
+	 *	side = number of nodes on the source side
+	 *	one node per line
+	 *	cut = number of edges in the cut
+	 *	u v c per line, where u is on the source side
+	 *
+	 */
+
+	side = xmalloc(g->n);
+	k = min_cut(g, side, &cut);
+	orig = g->orig;
+
+	for (i = sum = 0; i < g->n; i += 1)
+		sum += side[i];
+
+	printf("side = %d\n", sum);
+
+	for (i = 0; i < g->n; i += 1)
+		if (side[i])
+			printf("%d\n", orig != NULL ? orig[i] : i);
+
+	printf("cut = %d\n", k);
+
+	for (i = sum = 0; i < k; i += 1) {
+		printf("%d %d %d\n",
+			orig != NULL ? orig[cut[i].u] : cut[i].u,
+			orig != NULL ? orig[cut[i].v] : cut[i].v,
+			cut[i].c);
+		sum += cut[i].c;
+	}
+
+	if (sum != f)
+		error("cut has capacity %d but the flow is %d", sum, f);
+
+	free(cut);
+	free(side);
+}
+
+static void free_graph(graph_t* g)
+{
+#if MMAP_INPUT
+	if (g->file.buf != NULL)
+		close_input(&g->file);
+	else
+#endif
+	{
+		free(g->first);
+		free(g->arc);
+	}
+
+	free(g->bucket);
+	free(g->ring);
+	free(g->queue);
+	free(g->layer);
+	free(g->orig);
 	free(g->v);
-	free(g->e);
 	free(g);
 }
 
@@ -524,26 +1461,82 @@ int main(int argc, char* argv[])
 	int		f;	/* output from preflow.		*/
 	int		n;	/* number of nodes.		*/
 	int		m;	/* number of edges.		*/
+	int		order;	/* how to renumber the nodes.	*/
+	int		select;	/* which excess node next.	*/
+	double		alpha;	/* how often to global_relabel.	*/
+	int		phases;	/* 2 to make a flow of the preflow.	*/
+	int		cut;	/* print a minimum cut too.	*/
+	int		c;
 
 	progname = argv[0];	/* name is a string in argv[0]. */
 
+	order = ORDER_NONE;
+	select = SELECT_LIFO;
+	alpha = 6;
+	phases = 1;
+	cut = 0;
+
+	while ((c = getopt(argc, argv, "cfg:r:s:")) != -1) {
+		if (c == 'r' && strcmp(optarg, "bfs") == 0)
+			order = ORDER_BFS;
+		else if (c == 'r' && strcmp(optarg, "rcm") == 0)
+			order = ORDER_RCM;
+		else if (c == 'r' && strcmp(optarg, "degree") == 0)
+			order = ORDER_DEGREE;
+		else if (c == 's' && strcmp(optarg, "lifo") == 0)
+			select = SELECT_LIFO;
+		else if (c == 's' && strcmp(optarg, "highest") == 0)
+			select = SELECT_HIGHEST;
+		else if (c == 's' && strcmp(optarg, "fifo") == 0)
+			select = SELECT_FIFO;
+		else if (c == 's' && strcmp(optarg, "scaling") == 0)
+			select = SELECT_SCALING;
+		else if (c == 'g' && (alpha = atof(optarg)) >= 0)
+			;
+		else if (c == 'f')
+			phases = 2;
+		else if (c == 'c')
+			cut = 1;
+		else
+			error("usage: %s [-c] [-f] [-g alpha] [-r bfs|rcm|degree] [-s lifo|fifo|highest|scaling] < graph", progname);
+	}
+
 	in = stdin;		/* same as System.in in Java.	*/
 
-	n = next_int();
-	m = next_int();
+#if MMAP_INPUT
+	open_input(&input, fileno(in));
+
+	if (is_graphfile(&input))
+		g = map_graph(&input);
+	else {
+#endif
+		n = next_int();
+		m = next_int();
+
+		/* skip C and P from the 6railwayplanning lab in EDAF05 */
+		next_int();
+		next_int();
 
-	/* skip C and P from the 6railwayplanning lab in EDAF05 */
-	next_int();
-	next_int();
+		g = new_graph(in, n, m);
+#if MMAP_INPUT
+	}
+#endif
 
-	g = new_graph(in, n, m);
+#if MMAP_INPUT
+	close_input(&input);
+#endif
 
 	fclose(in);
 
-	f = preflow(g);
+	renumber(g, order);
+
+	f = preflow(g, select, alpha, phases);
 
 	printf("f = %d\n", f);
 
+	if (cut)
+		print_cut(g, f);
+
 	free_graph(g);
 
 	return 0;
@@ -0,0 +1,142 @@
+/* convert a graph in the text format of the labs, i.e. "n m C P"
+ * followed by m lines "u v c", to the binary format in graphfile.h.
+ *
+ * run with: ./text2bin < ../data/big/000.in > 000.bin
+ *
+ * the binary file can then be given to preflow instead of the text.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graphfile.h"
+
+static void error(const char* msg)
+{
+	fprintf(stderr, "text2bin: error: %s\n", msg);
+	exit(1);
+}
+
+static int next_int()
+{
+	int		x;
+	int		c;
+
+	while ((c = getchar()) != EOF && !isdigit(c))
+		;
+
+	if (c == EOF)
+		error("unexpected end of input");
+
+	x = c - '0';
+	while (isdigit(c = getchar()))
+		x = 10 * x + c - '0';
+
+	return x;
+}
+
+static void* xcalloc(size_t n, size_t s)
+{
+	void*		p;
+
+	p = calloc(n, s);
+
+	if (p == NULL)
+		error("out of memory");
+
+	return p;
+}
+
+int main(void)
+{
+	graphfile_t*	h;
+	graphfile_arc_t* arc;
+	int32_t*	first;
+	int32_t*	next;
+	int*		a;
+	int*		b;
+	int*		c;
+	size_t		size;
+	int		n;
+	int		m;
+	int		i;
+	int		j;
+	int		k;
+
+	n = next_int();
+	m = next_int();
+
+	/* skip C and P. */
+	next_int();
+	next_int();
+
+	if (n < 2 || m < 0)
+		error("bad n or m");
+
+	a = xcalloc(m, sizeof(int));
+	b = xcalloc(m, sizeof(int));
+	c = xcalloc(m, sizeof(int));
+
+	for (i = 0; i < m; i += 1) {
+		a[i] = next_int();
+		b[i] = next_int();
+		c[i] = next_int();
+		if (a[i] >= n || b[i] >= n)
+			error("node out of range");
+	}
+
+	/* build the file in memory and write it with one fwrite. */
+
+	size = graphfile_size(n, m);
+	h = xcalloc(1, size);
+	h->magic = GRAPHFILE_MAGIC;
+	h->version = GRAPHFILE_VERSION;
+	h->n = n;
+	h->m = m;
+	h->s = 0;
+	h->t = n - 1;
+
+	first = graphfile_first(h);
+	arc = graphfile_arc(h);
+
+	/* count the degrees in first[u + 1] and then sum them up so that
+	 * first[u] is where the arcs of u begin.
+	 *
+	 */
+
+	for (i = 0; i < m; i += 1) {
+		first[a[i] + 1] += 1;
+		first[b[i] + 1] += 1;
+	}
+
+	for (i = 0; i < n; i += 1)
+		first[i + 1] += first[i];
+
+	next = xcalloc(n, sizeof(int32_t));
+	memcpy(next, first, n * sizeof(int32_t));
+
+	for (i = 0; i < m; i += 1) {
+		j = next[a[i]]++;
+		k = next[b[i]]++;
+		arc[j].v = b[i];
+		arc[j].rev = k;
+		arc[j].c = c[i];
+		arc[k].v = a[i];
+		arc[k].rev = j;
+		arc[k].c = c[i];
+	}
+
+	if (fwrite(h, 1, size, stdout) != size || fflush(stdout) != 0)
+		error("write failed");
+
+	free(next);
+	free(h);
+	free(a);
+	free(b);
+	free(c);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* time one barrier_wait for 1, 2, 4, ... threads with each kind of
+ * barrier in barrier.c. every thread waits rounds times in a row, so
+ * the time per round is the latency of the barrier with no work in
+ * between, which is the worst case for the solver.
+ *
+ * the barriers are made by barrier_init with PREFLOW_BARRIER set, as
+ * in preflow, so with more threads than CPUs the spin column shows
+ * the futex it then falls back to.
+ *
+ * run with: make bench
+ *
+ * usage: ./bench [-r rounds] [-t max threads]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "barrier.h"
+
+typedef struct {
+	barrier_t*	barrier;
+	int		rounds;
+} bench_t;
+
+static double now(void)
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void* run(void* arg)
+{
+	bench_t*	b = arg;
+	int		i;
+
+	for (i = 0; i < b->rounds; i += 1)
+		barrier_wait(b->barrier);
+
+	return NULL;
+}
+
+static double measure(int nthreads, const char* kind, int rounds)
+{
+	barrier_t	barrier;
+	bench_t		b;
+	pthread_t*	thread;
+	double		begin;
+	double		end;
+	int		i;
+
+	setenv("PREFLOW_BARRIER", kind, 1);
+
+	if (barrier_init(&barrier, nthreads) != 0) {
+		fprintf(stderr, "bench: barrier_init failed\n");
+		exit(1);
+	}
+
+	b.barrier = &barrier;
+	b.rounds = rounds;
+
+	thread = calloc(nthreads, sizeof(pthread_t));
+
+	if (thread == NULL) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+
+	/* the main thread is one of the waiters, like in preflow. */
+
+	for (i = 1; i < nthreads; i += 1)
+		pthread_create(&thread[i], NULL, run, &b);
+
+	barrier_wait(&barrier);
+	begin = now();
+
+	for (i = 1; i < rounds; i += 1)
+		barrier_wait(&barrier);
+
+	end = now();
+
+	for (i = 1; i < nthreads; i += 1)
+		pthread_join(thread[i], NULL);
+
+	free(thread);
+	barrier_destroy(&barrier);
+
+	return (end - begin) / (rounds - 1) * 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+	int		rounds;
+	int		max;
+	int		n;
+	int		c;
+
+	rounds = 100000;
+	max = barrier_cpus();
+
+	while ((c = getopt(argc, argv, "r:t:")) != -1) {
+		if (c == 'r')
+			rounds = atoi(optarg);
+		else if (c == 't')
+			max = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-r rounds] [-t max threads]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (rounds < 2 || max < 1) {
+		fprintf(stderr, "bench: need at least 2 rounds and 1 thread\n");
+		exit(1);
+	}
+
+	printf("%8s %12s %12s %12s\n", "threads", "pthread", "futex", "spin");
+
+	for (n = 1; n <= max; n *= 2) {
+		printf("%8d", n);
+		printf(" %9.0f ns", measure(n, "pthread", rounds));
+		printf(" %9.0f ns", measure(n, "futex", rounds));
+		printf(" %9.0f ns", measure(n, "spin", rounds));
+		printf("\n");
+		fflush(stdout);
+
+		if (n < max && 2 * n > max)
+			n = max / 2;
+	}
+
+	return 0;
+}
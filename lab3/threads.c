@@ -0,0 +1,224 @@
+#define _GNU_SOURCE	/* for sched_getaffinity and CPU_SET. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "threads.h"
+
+static int	affinity_done;	/* PREFLOW_AFFINITY has been read.	*/
+static int	ncpu;		/* zero when the threads are not pinned.	*/
+static int*	cpu;		/* thread i runs on cpu[i % ncpu].	*/
+static long*	cpu_key;	/* order of the CPUs, see affinity.	*/
+
+static void* xmalloc(size_t s)
+{
+	void*		p;
+
+	p = malloc(s);
+
+	if (p == NULL)
+		error("out of memory: malloc(%zu) failed", s);
+
+	return p;
+}
+
+int cpu_count(void)
+{
+	cpu_set_t	set;
+	long		n;
+
+	/* the number of CPUs we may run on, which can be fewer than
+	 * the online ones with taskset or in a container.
+	 *
+	 */
+
+	if (sched_getaffinity(0, sizeof set, &set) == 0)
+		return CPU_COUNT(&set);
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+int thread_count(void)
+{
+	char*		s;
+	int		n;
+
+	/* PREFLOW_THREADS if it is set, and otherwise one thread
+	 * for each CPU we may run on.
+	 *
+	 */
+
+	s = getenv("PREFLOW_THREADS");
+
+	if (s == NULL || *s == 0)
+		return cpu_count();
+
+	n = atoi(s);
+
+	if (n < 1)
+		error("PREFLOW_THREADS must be at least 1, not %s", s);
+
+	return n;
+}
+
+static int topology(int c, const char* what)
+{
+	FILE*		fp;
+	char		name[128];
+	int		x;
+
+	snprintf(name, sizeof name,
+		"/sys/devices/system/cpu/cpu%d/topology/%s", c, what);
+
+	fp = fopen(name, "r");
+
+	if (fp == NULL)
+		return -1;
+
+	if (fscanf(fp, "%d", &x) != 1)
+		x = -1;
+
+	fclose(fp);
+
+	return x;
+}
+
+static int cpu_before(const void* ap, const void* bp)
+{
+	long		a = cpu_key[*(const int*) ap];
+	long		b = cpu_key[*(const int*) bp];
+
+	return (a > b) - (a < b);
+}
+
+static void affinity(void)
+{
+	cpu_set_t	set;
+	char*		s;
+	char*		p;
+	char*		q;
+	int*		package;
+	int*		core;
+	int		rank;
+	int		a;
+	int		b;
+	int		i;
+	int		j;
+
+	/* PREFLOW_AFFINITY says which CPUs the threads run on:
+	 *
+	 *	compact		close together: the hardware threads of
+	 *			one core, then the next core, and the
+	 *			next package when one is full.
+	 *
+	 *	scatter		far apart: one core in each package in
+	 *			turn, and the second hardware thread of
+	 *			a core only when all cores have one.
+	 *
+	 *	0,2,4-7		the CPUs in the list, in that order.
+	 *
+	 * if it is not set the threads are not pinned and the kernel
+	 * moves them as it likes. compact and scatter use the CPUs we
+	 * may run on, in the order of a key made from the package,
+	 * the core, and the rank among the CPUs of the same core.
+	 *
+	 */
+
+	affinity_done = 1;
+	s = getenv("PREFLOW_AFFINITY");
+
+	if (s == NULL || *s == 0 || strcmp(s, "none") == 0)
+		return;
+
+	if (strcmp(s, "compact") == 0 || strcmp(s, "scatter") == 0) {
+		if (sched_getaffinity(0, sizeof set, &set) != 0)
+			error("sched_getaffinity failed");
+
+		cpu = xmalloc(CPU_SETSIZE * sizeof(int));
+		package = xmalloc(CPU_SETSIZE * sizeof(int));
+		core = xmalloc(CPU_SETSIZE * sizeof(int));
+		cpu_key = xmalloc(CPU_SETSIZE * sizeof(long));
+
+		for (i = 0; i < CPU_SETSIZE; i += 1) {
+			if (!CPU_ISSET(i, &set))
+				continue;
+
+			package[i] = topology(i, "physical_package_id") & 0xfff;
+			core[i] = topology(i, "core_id");
+			if (core[i] < 0)
+				core[i] = i;
+			core[i] &= 0xfffff;
+
+			for (j = rank = 0; j < ncpu; j += 1)
+				if (package[cpu[j]] == package[i] && core[cpu[j]] == core[i])
+					rank += 1;
+
+			if (s[0] == 'c')
+				cpu_key[i] = (long) package[i] << 40 | (long) core[i] << 20 | rank;
+			else
+				cpu_key[i] = (long) rank << 40 | (long) core[i] << 12 | package[i];
+
+			cpu[ncpu++] = i;
+		}
+
+		qsort(cpu, ncpu, sizeof(int), cpu_before);
+
+		free(package);
+		free(core);
+		free(cpu_key);
+
+		return;
+	}
+
+	cpu = xmalloc(CPU_SETSIZE * sizeof(int));
+
+	for (p = s; *p != 0; p += *p == ',') {
+		q = p;
+		a = b = strtol(q, &p, 10);
+		if (*p == '-')
+			b = strtol(q = p + 1, &p, 10);
+
+		if (p == q || a < 0 || b < a || b >= CPU_SETSIZE || (*p != ',' && *p != 0))
+			error("PREFLOW_AFFINITY should be compact, scatter or a list such as 0,2,4-7, not %s", s);
+
+		for (i = a; i <= b && ncpu < CPU_SETSIZE; i += 1)
+			cpu[ncpu++] = i;
+	}
+}
+
+void start_thread(pthread_t* thread, int i, void* (*f)(void*), void* arg)
+{
+	pthread_attr_t	attr;
+	cpu_set_t	set;
+
+	/* start thread number i running f(arg), on its CPU if
+	 * PREFLOW_AFFINITY is set. the CPU is in the attributes so
+	 * the thread runs there from its first instruction, and every
+	 * page it touches first is placed next to that CPU.
+	 *
+	 */
+
+	if (!affinity_done)
+		affinity();
+
+	if (pthread_attr_init(&attr) != 0)
+		error("pthread_attr_init failed");
+
+	if (ncpu > 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu[i % ncpu], &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof set, &set) != 0)
+			error("cannot run thread %d on CPU %d", i, cpu[i % ncpu]);
+	}
+
+	if (pthread_create(thread, &attr, f, arg) != 0)
+		error("pthread_create of thread %d failed", i);
+
+	pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,26 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+/* how many threads to run and on which CPUs.
+ *
+ * thread_count is PREFLOW_THREADS if it is set and otherwise the
+ * number of CPUs we may run on, cpu_count, which is what taskset or
+ * the container leaves us and not all online CPUs.
+ *
+ * start_thread starts thread number i on the CPU that PREFLOW_AFFINITY
+ * gives it (see affinity in threads.c), or anywhere if it is not set.
+ *
+ * a bad PREFLOW_THREADS or PREFLOW_AFFINITY, or a thread that cannot
+ * be started, is reported with error, which the program supplies.
+ *
+ */
+
+#include <pthread.h>
+
+int cpu_count(void);
+int thread_count(void);
+void start_thread(pthread_t* thread, int i, void* (*f)(void*), void* arg);
+
+void error(const char* fmt, ...);
+
+#endif /* THREADS_H */
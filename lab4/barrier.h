@@ -0,0 +1,70 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+/* a barrier for the rounds of the solver.
+ *
+ * BARRIER_PTHREAD is pthread_barrier_wait, which with glibc puts
+ * every thread but the last to sleep in the kernel, and with the
+ * emulation in pthread_barrier.c takes a mutex and a condition
+ * variable. when a round is only a few microseconds that is most
+ * of the time of the round.
+ *
+ * BARRIER_SPIN is a sense-reversing barrier: the last thread to
+ * arrive flips sense and the others spin until they see it flip.
+ * they spin for at most spin nanoseconds and then sleep on a futex,
+ * so a long round, e.g. with a global relabel, does not keep idle
+ * CPUs busy.
+ *
+ * barrier_init takes the kind from PREFLOW_BARRIER, which can be
+ * pthread, spin or futex (spin without spinning), and BARRIER_DEFAULT
+ * when it is not set. count is the workers plus the main thread, and
+ * with more workers than barrier_cpus, the CPUs we may run on, it
+ * does not spin.
+ *
+ */
+
+#include <pthread.h>
+
+#include "pthread_barrier.h"
+
+#define BARRIER_PTHREAD	0
+#define BARRIER_SPIN	1
+
+#ifndef BARRIER_DEFAULT
+#define BARRIER_DEFAULT	BARRIER_SPIN
+#endif
+
+#ifndef BARRIER_SPIN_NS
+#define BARRIER_SPIN_NS	20000	/* spin at most 20 us before sleeping. */
+#endif
+
+typedef struct barrier_t barrier_t;
+
+struct barrier_t {
+	int		kind;		/* BARRIER_PTHREAD or BARRIER_SPIN.	*/
+	unsigned	count;		/* threads which wait each round.	*/
+	long		spin;		/* ns to spin before the futex.	*/
+	pthread_barrier_t pthread;	/* with BARRIER_PTHREAD.		*/
+
+	/* the arrivals and the spinning are on separate cache lines
+	 * so the threads arriving late do not steal the line from
+	 * the ones waiting for sense. padding rather than aligned
+	 * since the graph_t it is in comes from malloc.
+	 *
+	 */
+
+	char		pad0[64];
+	unsigned	left;		/* yet to arrive this round.	*/
+	char		pad1[64];
+	unsigned	sense;		/* flips each round.		*/
+	unsigned	sleepers;	/* waiting in the kernel.	*/
+	char		pad2[64];
+};
+
+int barrier_cpus(void);
+int barrier_init(barrier_t* b, unsigned count);
+int barrier_init_kind(barrier_t* b, unsigned count, int kind, long spin);
+int barrier_wait(barrier_t* b);
+void barrier_destroy(barrier_t* b);
+
+#endif /* BARRIER_H */
@@ -0,0 +1,43 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+/* reading the numbers of the graph.
+ *
+ * with MMAP_INPUT open_input makes all of the input available in
+ * memory at once, mapped if it is a file and read if it is a pipe,
+ * and next_int and scan_int take the numbers from there. without it
+ * next_int reads stdin with getchar.
+ *
+ * errors are reported with error, which the program supplies.
+ *
+ */
+
+#include <stddef.h>
+
+#ifndef MMAP_INPUT
+#define MMAP_INPUT	1	/* mmap/read input instead of getchar. */
+#endif
+
+typedef struct input_t	input_t;
+
+struct input_t {
+	char*		buf;	/* all of the input.		*/
+	char*		p;	/* next character to read.	*/
+	char*		end;	/* one past the last character.	*/
+	size_t		size;	/* bytes mapped or allocated.	*/
+	int		mapped;	/* buf is from mmap, not malloc.	*/
+};
+
+#if MMAP_INPUT
+extern input_t input;	/* stdin when MMAP_INPUT is set. */
+
+void open_input(input_t* in, int fd);
+void close_input(input_t* in);
+int scan_int(char** pp, const char* end);
+#endif
+
+int next_int(void);
+
+void error(const char* fmt, ...);
+
+#endif /* INPUT_H */
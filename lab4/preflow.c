@@ -1,8 +1,12 @@
 /* This is an implementation of the preflow-push algorithm, by
  * Goldberg and Tarjan, for the 2021 EDAN26 Multicore programming labs.
  *
- * It is intended to be as simple as possible to understand and is
- * not optimized in any way.
+ * It was first written to be as simple as possible to understand and
+ * has since been optimized: the input is mapped and parsed by several
+ * threads, the arcs are stored in CSR form with the hot node fields in
+ * separate arrays, the large arrays can be placed on NUMA nodes and
+ * huge pages, and besides the barrier rounds of lab 3 there is a
+ * lock-free engine with atomic pushes and relabels.
  *
  * You should NOT read everything for this course.
  *
@@ -33,7 +37,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
+#include <sched.h>
+
+#include "barrier.h"
+#include "input.h"
+#include "threads.h"
 
 #define PRINT		0	/* enable/disable prints. */
 
@@ -52,6 +67,39 @@
 #endif
 
 #define MIN(a,b)	(((a)<=(b))?(a):(b))
+#define MAX(a,b)	(((a)>=(b))?(a):(b))
+
+#ifndef SPLIT_NODES
+#define SPLIT_NODES	1	/* hot node fields in separate arrays. */
+#endif
+
+#define CACHE_LINE	64	/* bytes in a cache block. */
+#define HUGE_PAGE	(2 << 20)	/* bytes in a MAP_HUGETLB page. */
+#define GRAIN		16	/* fewest nodes in a chunk of work. */
+#define GRAIN_ARCS	256	/* or arcs with SCHEDULE_DEGREE. */
+
+/* with SPLIT_NODES the height, excess and in-excess flag of node u are
+ * not in u itself but in g->h, g->e and g->flags at the index of u.
+ * the workers read the heights of the neighbours of their nodes while
+ * others change the excess of nodes nearby, and with all fields in one
+ * node_t these end up in the same cache blocks which then move back
+ * and forth between the cores (false sharing). in separate arrays the
+ * heights, which do not change while the workers run, stay shared.
+ *
+ * compile with -DSPLIT_NODES=0 (make aos) to get all of them in node_t
+ * to compare.
+ *
+ */
+
+#if SPLIT_NODES
+#define H(g,u)		((g)->h[(u) - (g)->v])
+#define E(g,u)		((g)->e[(u) - (g)->v])
+#define IN_EXCESS(g,u)	((g)->flags[(u) - (g)->v])
+#else
+#define H(g,u)		((u)->h)
+#define E(g,u)		((u)->e)
+#define IN_EXCESS(g,u)	((u)->inExcess)
+#endif
 
 /* introduce names for some structs. a struct is like a class, except
  * it cannot be extended and has no member methods, and everything is
@@ -65,79 +113,158 @@
 typedef struct graph_t	graph_t;
 typedef struct node_t	node_t;
 typedef struct edge_t	edge_t;
-typedef struct list_t	list_t;
+typedef struct arc_t	arc_t;
 typedef struct push_list_t	push_list_t;
 typedef struct node_list_t	node_list_t;
 typedef struct push_t	push_t;
 typedef struct work_arg_t	work_arg_t;
 typedef struct node_list_t node_list_t;
-
-struct list_t {
-	edge_t*		edge;
-	list_t*		next;
-};
+typedef struct load_t	load_t;
+typedef struct load_arg_t	load_arg_t;
+typedef struct inbox_t	inbox_t;
 
 struct work_arg_t {
 	int		   index;
 	graph_t* g;
   int      nThreads;
+  long     load;  // nodes and arcs looked at in this round
+  int      taken;  // our slice with SCHEDULE_STATIC
+};
+
+struct load_t {
+	graph_t*	g;
+	int		nThreads;
+	pthread_barrier_t barrier;
+	char*		text;	/* the input after the first line.	*/
+	char*		end;	/* end of the input.		*/
+	long*		count;	/* numbers in each thread's chunk.	*/
+	int*		sum;	/* degree sum of each thread's nodes.	*/
+	int*		next;	/* degree, then next arc, of each node.	*/
+	edge_t*		e;	/* the m edges of the input.	*/
+};
+
+struct load_arg_t {
+	load_t*		load;
+	int		index;
 };
 
+// each thread's lists are on their own cache block
 struct push_list_t {
   push_t* a;
   int     c;
   int     i;
-};
+} __attribute__((aligned(CACHE_LINE)));
 
 struct node_list_t {
   node_t** a;
   int      c;
   int      i;
-};
+} __attribute__((aligned(CACHE_LINE)));
+
+// nodes given to a thread in the atomic engine, see atomic_preflow
+struct inbox_t {
+	node_t*		head;	/* pushed by anyone, taken by owner.	*/
+} __attribute__((aligned(CACHE_LINE)));
 
 struct node_t {
+#if !SPLIT_NODES
 	int		h;	/* height.			*/
 	int		e;	/* excess flow.			*/
-	list_t*		edge;	/* adjacency list.		*/
-	node_t*		next;	/* with excess preflow.		*/
   int  inExcess;
+#endif
+	node_t*		next;	/* with excess preflow.		*/
 };
 
 struct edge_t {
-	node_t*		u;	/* one of the two nodes.	*/
-	node_t*		v;	/* the other. 			*/
-	int		f;	/* flow > 0 if from u to v.	*/
+	int		u;	/* one of the two nodes.	*/
+	int		v;	/* the other. 			*/
 	int		c;	/* capacity.			*/
 };
 
+struct arc_t {
+	int		v;	/* the node the arc goes to.	*/
+	int		rev;	/* index of the reverse arc.	*/
+	int		r;	/* residual capacity.		*/
+};
+
 struct push_t {
   node_t* u; // Push from u
   node_t* v; // Push to v
-  edge_t* e; // Edge to push along
-  int d; // Directed flow to push
+  int d; // Flow to push
 };
 
 struct graph_t {
 	int		n;	/* nodes.			*/
 	int		m;	/* edges.			*/
 	node_t*		v;	/* array of n nodes.		*/
-	edge_t*		e;	/* array of m edges.		*/
+#if SPLIT_NODES
+	int*		h;	/* height of v[i].		*/
+	int*		e;	/* excess flow of v[i].		*/
+	char*		flags;	/* v[i] is in the excess list.	*/
+#endif
+	int*		first;	/* arcs of v[i] start at first[i].	*/
+	arc_t*		arc;	/* array of 2m arcs.		*/
 	node_t*		s;	/* source.			*/
 	node_t*		t;	/* sink.			*/
 	node_t*		excess;	/* nodes with e > 0 except s,t.	*/
-  pthread_barrier_t barrier;
+	int*		queue;	/* for global_relabel.		*/
+	long		work;	/* since the last global_relabel.	*/
+	int		phase;	/* 1 or 2, see preflow.		*/
+  barrier_t barrier;	// between the rounds, see barrier.h
   push_list_t** pushes;
   node_list_t** relabels;
   node_list_t* workList;
   pthread_mutex_t mutex;
   int done;
+	int		nThreads;	/* workers.			*/
+	int		block;	/* nodes in a block, see owner.	*/
+	int		phases;	/* 2 to make a flow of the preflow.	*/
+	int		active;	/* nodes with excess to discharge.	*/
+	inbox_t*	inbox;	/* one per thread, atomic engine.	*/
+	int		cursor;	/* next node to take in workList.	*/
+	long		weight;	/* degrees summed over workList.	*/
+	long		taken;	/* degrees of the nodes taken.	*/
+	int		rounds;	/* for the statistics in preflow.	*/
+	double		imbalance;	/* summed over the rounds.	*/
+	double		worst;	/* largest in a round.		*/
 };
 
+enum {
+	ENGINE_BARRIER,		/* workers and main thread in rounds.	*/
+	ENGINE_ATOMIC,		/* lock-free, see atomic_preflow.	*/
+};
+
+enum {
+	PLACE_DEFAULT,		/* see big_alloc.		*/
+	PLACE_INTERLEAVE,
+	PLACE_FIRST_TOUCH,
+};
+
+enum {
+	PAGES_NORMAL,
+	PAGES_THP,
+	PAGES_HUGETLB,
+};
+
+enum {
+	SCHEDULE_STATIC,	/* see take_chunk.		*/
+	SCHEDULE_DYNAMIC,
+	SCHEDULE_DEGREE,
+};
+
+/* the adjacency is stored as in lab0: the arcs leaving v[i] are
+ * arc[first[i]] to arc[first[i+1] - 1]. an edge (u, v, c) becomes one
+ * arc from u and one from v, both with residual capacity c, and a push
+ * of d takes d from the residual capacity of its arc and gives it to
+ * the reverse arc, found through rev.
+ *
+ */
+
 /* a remark about C arrays. the phrase above 'array of n nodes' is using
  * the word 'array' in a general sense for any language. in C an array
  * (i.e., the technical term array in ISO C) is declared as: int x[10],
  * i.e., with [size] but for convenience most people refer to the data
- * in memory as an array here despite the graph_t's v and e members
+ * in memory as an array here despite the graph_t's v and arc members
  * are not strictly arrays. they are pointers. once we have allocated
  * memory for the data in the ''array'' for the pointer, the syntax of
  * using an array or pointer is the same so we can refer to a node with
@@ -146,7 +273,7 @@ struct graph_t {
  *
  * where the -> is identical to Java's . in this expression.
  *
- * in summary: just use the v and e as arrays.
+ * in summary: just use the v and arc as arrays.
  *
  * a difference between C and Java is that in Java you can really not
  * have an array of nodes as we do. instead you need to have an array
@@ -158,8 +285,6 @@ struct graph_t {
 
 static char* progname;
 
-#if PRINT
-
 static int id(graph_t* g, node_t* v)
 {
 	/* return the node index for v.
@@ -184,7 +309,6 @@ static int id(graph_t* g, node_t* v)
 
 	return v - g->v;
 }
-#endif
 
 void error(const char* fmt, ...)
 {
@@ -228,32 +352,6 @@ void error(const char* fmt, ...)
 	exit(1);
 }
 
-static int next_int()
-{
-        int     x;
-        int     c;
-
-	/* this is like Java's nextInt to get the next integer.
-	 *
-	 * we read the next integer one digit at a time which is
-	 * simpler and faster than using the normal function
-	 * fscanf that needs to do more work.
-	 *
-	 * we get the value of a digit character by subtracting '0'
-	 * so the character '4' gives '4' - '0' == 4
-	 *
-	 * it works like this: say the next input is 124
-	 * x is first 0, then 1, then 10 + 2, and then 120 + 4.
-	 *
-	 */
-
-	x = 0;
-        while (isdigit(c = getchar()))
-                x = 10 * x + c - '0';
-
-        return x;
-}
-
 static void* xmalloc(size_t s)
 {
 	void*		p;
@@ -279,6 +377,25 @@ static void* xmalloc(size_t s)
 	return p;
 }
 
+static void* xaligned(size_t s)
+{
+	void*		p;
+
+	/* as xmalloc but the memory starts at a cache block and the
+	 * size is rounded up to whole cache blocks, so that nothing
+	 * else ends up in the same cache blocks.
+	 *
+	 */
+
+	s = (s + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	p = aligned_alloc(CACHE_LINE, s);
+
+	if (p == NULL)
+		error("out of memory: aligned_alloc(%zu) failed", s);
+
+	return p;
+}
+
 static void* xcalloc(size_t n, size_t s)
 {
 	void*		p;
@@ -303,22 +420,208 @@ static void* xcalloc(size_t n, size_t s)
 	return p;
 }
 
-static void add_edge(node_t* u, edge_t* e)
+
+/* the large arrays of the graph, i.e. the nodes, heights, excess,
+ * flags and arcs, are allocated with big_alloc and freed with big_free
+ * so that we can choose where their memory is (see main):
+ *
+ *	PLACE_DEFAULT		calloc on the main thread, so on a machine
+ *				with several sockets (NUMA nodes) all pages
+ *				are on the socket of the main thread.
+ *	PLACE_INTERLEAVE	pages are spread round robin over all NUMA
+ *				nodes with mbind.
+ *	PLACE_FIRST_TOUCH	the pages are not touched by big_alloc but
+ *				by the loader threads, and Linux puts a
+ *				page on the NUMA node of the first thread
+ *				that touches it. loader thread i touches
+ *				the nodes which worker i owns in the
+ *				atomic engine (see owner) and their arcs,
+ *				so those end up next to the worker. the
+ *				barrier engine has no owners and gets the
+ *				same pages spread over the threads' nodes.
+ *
+ * and with which pages:
+ *
+ *	PAGES_NORMAL		the usual 4 KiB pages.
+ *	PAGES_THP		ask for transparent huge pages with madvise.
+ *	PAGES_HUGETLB		map the arrays with MAP_HUGETLB, which only
+ *				works if the system has reserved huge pages,
+ *				and if not we use normal pages.
+ *
+ * huge pages mean fewer TLB misses when following arcs all over the
+ * arrays.
+ *
+ */
+
+#define BIG_ARRAYS	8	/* most arrays from big_alloc at once. */
+
+static struct {
+	void*		p;	/* from mmap, or NULL if free.	*/
+	size_t		size;	/* bytes mapped.		*/
+} big[BIG_ARRAYS];
+
+static int	placement = PLACE_DEFAULT;
+static int	pages = PAGES_NORMAL;
+static int	numa_nodes = 1;
+static int	hugetlb_failed;
+static int	schedule = SCHEDULE_DYNAMIC;
+static int	stats;	/* print load imbalance statistics. */
+
+static int count_numa_nodes(void)
+{
+	FILE*		fp;
+	int		a;
+	int		b;
+	int		max;
+	int		c;
+
+	/* the file has a list such as 0-1,3 of the online nodes. */
+
+	fp = fopen("/sys/devices/system/node/online", "r");
+	if (fp == NULL)
+		return 1;
+
+	max = 0;
+	while (fscanf(fp, "%d", &a) == 1) {
+		b = a;
+		if ((c = getc(fp)) == '-' && fscanf(fp, "%d", &b) == 1)
+			c = getc(fp);
+		if (b > max)
+			max = b;
+		if (c != ',')
+			break;
+	}
+
+	fclose(fp);
+
+	return max + 1;
+}
+
+static size_t big_size(size_t s)
+{
+	size_t		page;
+
+	page = pages == PAGES_HUGETLB && !hugetlb_failed ? HUGE_PAGE : sysconf(_SC_PAGESIZE);
+
+	return (s + page - 1) / page * page;
+}
+
+static void* big_alloc(size_t n, size_t s)
+{
+	unsigned long	mask;
+	size_t		size;
+	void*		p;
+	int		flags;
+	int		i;
+
+	/* allocate n * s bytes of zeroes as chosen by placement and
+	 * pages. mmap gives us zeroed pages which have not been touched
+	 * so it is the first write that decides where a page goes.
+	 *
+	 */
+
+	if (placement == PLACE_DEFAULT && pages == PAGES_NORMAL)
+		return xcalloc(n, s);
+
+	size = big_size(n * s);
+	flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	p = MAP_FAILED;
+
+	if (pages == PAGES_HUGETLB && !hugetlb_failed) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED) {
+			hugetlb_failed = 1;
+			size = big_size(n * s);
+		}
+	}
+
+	if (p == MAP_FAILED)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+	if (p == MAP_FAILED)
+		error("out of memory: mmap(%zu) failed", size);
+
+	if (pages == PAGES_THP)
+		madvise(p, size, MADV_HUGEPAGE);
+
+	if (placement == PLACE_INTERLEAVE && numa_nodes > 1) {
+		mask = numa_nodes >= 64 ? ~0UL : (1UL << numa_nodes) - 1;
+		if (syscall(SYS_mbind, p, size, MPOL_INTERLEAVE, &mask, 8 * sizeof mask, 0) != 0)
+			fprintf(stderr, "%s: mbind failed, pages are not interleaved\n", progname);
+	}
+
+	if (placement == PLACE_DEFAULT)
+		memset(p, 0, n * s);
+
+	/* the size depends on whether this array got huge pages, and
+	 * a later array may not, so big_free cannot compute it again.
+	 *
+	 */
+
+	for (i = 0; i < BIG_ARRAYS && big[i].p != NULL; i += 1)
+		;
+
+	if (i == BIG_ARRAYS)
+		error("more than %d arrays from big_alloc", BIG_ARRAYS);
+
+	big[i].p = p;
+	big[i].size = size;
+
+	return p;
+}
+
+static void big_free(void* p)
 {
-	list_t*		p;
+	int		i;
 
-	/* allocate memory for a list link and put it first
-	 * in the adjacency list of u.
+	if (placement == PLACE_DEFAULT && pages == PAGES_NORMAL) {
+		free(p);
+		return;
+	}
+
+	for (i = 0; i < BIG_ARRAYS && big[i].p != p; i += 1)
+		;
+
+	assert(i < BIG_ARRAYS);
+
+	munmap(p, big[i].size);
+	big[i].p = NULL;
+}
+
+static void big_touch(void* p, size_t from, size_t to)
+{
+	char*		a;
+	size_t		page;
+
+	/* write to each page which begins in bytes from to to - 1 of
+	 * p so that it ends up on the NUMA node of this thread. the
+	 * threads touch ranges that together cover the array, so each
+	 * page is touched by exactly one of them. nothing to do unless
+	 * placement is first touch.
 	 *
 	 */
 
-	p = xmalloc(sizeof(list_t));
-	p->edge = e;
-	p->next = u->edge;
-	u->edge = p;
+	if (placement != PLACE_FIRST_TOUCH || from >= to)
+		return;
+
+	page = sysconf(_SC_PAGESIZE);
+	a = p;
+
+	for (from = (from + page - 1) / page * page; from < to; from += page)
+		a[from] = 0;
+}
+
+static void report_placement(void)
+{
+	static const char* place[] = { "default", "interleaved", "first touch" };
+	static const char* page[] = { "normal", "transparent huge", "hugetlb" };
+
+	fprintf(stderr, "%s: %s placement on %d NUMA node%s, %s pages\n",
+		progname, place[placement], numa_nodes, numa_nodes == 1 ? "" : "s",
+		page[hugetlb_failed ? PAGES_NORMAL : pages]);
 }
 
-static void add_push(graph_t* g, node_t* u, node_t* v, edge_t* e, int threadIndex)
+static void add_push(graph_t* g, node_t* u, node_t* v, int a, int threadIndex)
 {
   int d;
   if (g->pushes[threadIndex]->i == g->pushes[threadIndex]->c) {
@@ -330,21 +633,16 @@ static void add_push(graph_t* g, node_t* u, node_t* v, edge_t* e, int threadInde
     g->pushes[threadIndex]->a = b;
   }
 
-	if (u == e->u) {
-		d = MIN(u->e, e->c - e->f);
-		e->f += d;
-	} else {
-		d = MIN(u->e, e->c + e->f);
-		e->f -= d;
-	}
+	d = MIN(E(g, u), g->arc[a].r);
+	g->arc[a].r -= d;
+	g->arc[g->arc[a].rev].r += d;
 
-  pr("add_push changing excess node:%d, e=%d, d=%d\n", id(g,u), u->e, d);
-  u->e -= d;
+  pr("add_push changing excess node:%d, e=%d, d=%d\n", id(g,u), E(g, u), d);
+  E(g, u) -= d;
 
   int i = g->pushes[threadIndex]->i++;
   g->pushes[threadIndex]->a[i].u = u;
   g->pushes[threadIndex]->a[i].v = v;
-  g->pushes[threadIndex]->a[i].e = e;
   g->pushes[threadIndex]->a[i].d = d;
 }
 
@@ -362,6 +660,11 @@ static void add_relabel(graph_t* g, node_t* u, int threadIndex) {
   g->relabels[threadIndex]->i += 1;
 }
 
+static int degree(graph_t* g, node_t* u)
+{
+	return g->first[id(g, u) + 1] - g->first[id(g, u)];
+}
+
 static void add_work(graph_t* g, node_t* u) {
   if (g->workList->i == g->workList->c) {
     node_t** b;
@@ -377,58 +680,372 @@ static void add_work(graph_t* g, node_t* u) {
 
   g->workList->a[g->workList->i] = u;
   g->workList->i+=1;
+  g->weight += degree(g, u) + 1;
 }
 
-static void connect(node_t* u, node_t* v, int c, edge_t* e)
+#if MMAP_INPUT
+
+static char* chunk_start(load_t* load, int k)
 {
-	/* connect two nodes by putting a shared (same object)
-	 * in their adjacency lists.
+	char*		p;
+
+	/* chunk k begins at k/nThreads of the text, moved past the
+	 * rest of a number if it falls in one, so no number is split
+	 * between threads. an edge or a line can be.
 	 *
 	 */
 
-	e->u = u;
-	e->v = v;
-	e->c = c;
+	if (k == load->nThreads)
+		return load->end;
+
+	p = load->text + (load->end - load->text) * k / load->nThreads;
 
-	add_edge(u, e);
-	add_edge(v, e);
+	while (p > load->text && p < load->end && isdigit(p[-1]))
+		p += 1;
+
+	return p;
 }
 
-static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
+#endif
+
+static int arc_before(const void* ap, const void* bp)
 {
-	graph_t*	g;
-	node_t*		u;
-	node_t*		v;
+	int		a = ((const arc_t*) ap)->rev;
+	int		b = ((const arc_t*) bp)->rev;
+
+	return (a > b) - (a < b);
+}
+
+static void sort_arcs(arc_t* a, int n)
+{
+	arc_t		x;
+	int		i;
+	int		j;
+
+	/* the arcs of a node by the edge number in rev. they are
+	 * almost sorted already, since each thread adds its edges in
+	 * order, so insertion sort is best unless there are many.
+	 *
+	 */
+
+	if (n > 32) {
+		qsort(a, n, sizeof(arc_t), arc_before);
+		return;
+	}
+
+	for (i = 1; i < n; i += 1) {
+		x = a[i];
+		for (j = i; j > 0 && a[j-1].rev > x.rev; j -= 1)
+			a[j] = a[j-1];
+		a[j] = x;
+	}
+}
+
+static void* load_work(void* argsIn)
+{
+	load_arg_t*	args = argsIn;
+	load_t*		load = args->load;
+	graph_t*	g = load->g;
+	int		index = args->index;
+	int		nThreads = load->nThreads;
+	int*		next = load->next;
+	int*		pos;
+	edge_t*		e;
+	int		first;
+	int		last;
+	int		lo;
+	int		hi;
+	int		base;
+	int		start;
+	int		d;
 	int		i;
+	int		j;
+	int		k;
+	int		u;
+	int		w;
+
+	/* each thread builds the part of the graph from its chunk of
+	 * the input, its range of edges and its range of nodes, in
+	 * nine steps separated by barriers:
+	 *
+	 * 1. count the numbers in our chunk of the input.
+	 * 2. parse them into the edges, three numbers per edge.
+	 * 3. count the degree of the nodes of our edges in next.
+	 * 4. sum the degrees of our nodes.
+	 * 5. turn the degrees into where the arcs of each of our
+	 *    nodes begin.
+	 * 6. with PLACE_FIRST_TOUCH touch the arcs of the nodes which
+	 *    worker index owns, see owner. their node arrays were
+	 *    touched in step 4, here and not by the main thread.
+	 * 7. put the two arcs of each of our edges in the next free
+	 *    place of their nodes, with the edge number in rev.
+	 * 8. sort the arcs of each of our nodes by edge number and
+	 *    note where the arc of each end of each edge went.
+	 * 9. point rev of our arcs at the arc of the other end.
+	 *
+	 * after the sort the arcs of a node are in input order as in
+	 * the serial build, whatever the number of threads. next is
+	 * shared so the memory does not grow with the threads.
+	 *
+	 */
+
+#if MMAP_INPUT
+	char*		begin;
+	char*		end;
+	char*		x;
+	long		count;
+	long		t;
+	int		f;
 	int		a;
-	int		b;
-	int		c;
+
+	begin = chunk_start(load, index);
+	end = chunk_start(load, index + 1);
+
+	count = 0;
+	for (x = begin; x < end; ) {
+		while (x < end && !isdigit(*x))
+			x += 1;
+		if (x == end)
+			break;
+		count += 1;
+		while (x < end && isdigit(*x))
+			x += 1;
+	}
+
+	load->count[index] = count;
+
+	pthread_barrier_wait(&load->barrier);
+
+	t = 0;
+	for (k = 0; k < index; k += 1)
+		t += load->count[k];
+
+	/* our first number is number t of the edges, which is field
+	 * t % 3 of edge t / 3.
+	 *
+	 */
+
+	i = t / 3;
+	f = t % 3;
+	x = begin;
+
+	for (; count > 0 && i < g->m; count -= 1) {
+		a = scan_int(&x, end);
+		if (f == 0)
+			load->e[i].u = a;
+		else if (f == 1)
+			load->e[i].v = a;
+		else
+			load->e[i].c = a;
+
+		if (++f == 3) {
+			f = 0;
+			i += 1;
+		}
+	}
+
+	/* a short input gives zeroes as with next_int. */
+
+	if (index == nThreads - 1 && i < g->m) {
+		if (f > 0)
+			memset((int*) &load->e[i] + f, 0, (3 - f) * sizeof(int));
+		i += f > 0;
+		memset(&load->e[i], 0, (g->m - i) * sizeof(edge_t));
+	}
+
+	pthread_barrier_wait(&load->barrier);
+#endif
+
+	first = (long) g->m * index / nThreads;
+	last = (long) g->m * (index + 1) / nThreads;
+
+	for (i = first; i < last; i += 1) {
+		__atomic_fetch_add(&next[load->e[i].u], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&next[load->e[i].v], 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_barrier_wait(&load->barrier);
+
+	lo = (long) g->n * index / nThreads;
+	hi = (long) g->n * (index + 1) / nThreads;
+
+	for (u = index * g->block; u < g->n; u += nThreads * g->block) {
+		w = MIN(u + g->block, g->n);
+		big_touch(g->v, u * sizeof(node_t), w * sizeof(node_t));
+#if SPLIT_NODES
+		big_touch(g->h, u * sizeof(int), w * sizeof(int));
+		big_touch(g->e, u * sizeof(int), w * sizeof(int));
+		big_touch(g->flags, u, w);
+#endif
+	}
+
+	d = 0;
+	for (u = lo; u < hi; u += 1)
+		d += next[u];
+
+	load->sum[index] = d;
+
+	pthread_barrier_wait(&load->barrier);
+
+	base = 0;
+	for (k = 0; k < index; k += 1)
+		base += load->sum[k];
+
+	start = base;
+
+	for (u = lo; u < hi; u += 1) {
+		g->first[u] = base;
+		d = next[u];
+		next[u] = base;
+		base += d;
+	}
+
+	pthread_barrier_wait(&load->barrier);
+
+	for (u = index * g->block; u < g->n; u += nThreads * g->block) {
+		w = MIN(u + g->block, g->n);
+		big_touch(g->arc, (size_t) g->first[u] * sizeof(arc_t),
+			(w == g->n ? 2 * (size_t) g->m : (size_t) g->first[w]) * sizeof(arc_t));
+	}
+
+	pthread_barrier_wait(&load->barrier);
+
+	for (i = first; i < last; i += 1) {
+		e = &load->e[i];
+		j = __atomic_fetch_add(&next[e->u], 1, __ATOMIC_RELAXED);
+		k = __atomic_fetch_add(&next[e->v], 1, __ATOMIC_RELAXED);
+		g->arc[j].v = e->v;
+		g->arc[j].rev = 2 * i;
+		g->arc[j].r = e->c;
+		g->arc[k].v = e->u;
+		g->arc[k].rev = 2 * i + 1;
+		g->arc[k].r = e->c;
+	}
+
+	pthread_barrier_wait(&load->barrier);
+
+	/* the edges are not needed any more so their memory holds
+	 * where the arcs went: pos[2 * i] is the arc from u of edge
+	 * i and pos[2 * i + 1] the arc from v.
+	 *
+	 */
+
+	pos = (int*) load->e;
+
+	for (u = lo; u < hi; u += 1)
+		sort_arcs(&g->arc[g->first[u]], next[u] - g->first[u]);
+
+	for (j = start; j < base; j += 1)
+		pos[g->arc[j].rev] = j;
+
+	pthread_barrier_wait(&load->barrier);
+
+	for (j = start; j < base; j += 1)
+		g->arc[j].rev = pos[g->arc[j].rev ^ 1];
+
+	return NULL;
+}
+
+static void load_graph(graph_t* g, int nThreads)
+{
+	load_t		load;
+	load_arg_t*	args;
+	pthread_t*	thread;
+	int		i;
+
+	/* build the arcs with nThreads threads. with MMAP_INPUT the
+	 * threads also parse the edges, otherwise they are read here.
+	 *
+	 */
+
+	load.g = g;
+	load.nThreads = nThreads;
+#if MMAP_INPUT
+	load.text = input.p;
+	load.end = input.end;
+#endif
+	load.count = xcalloc(nThreads, sizeof(long));
+	load.sum = xcalloc(nThreads, sizeof(int));
+	load.next = xcalloc(g->n, sizeof(int));
+	load.e = xmalloc(g->m * sizeof(edge_t));
+
+#if !MMAP_INPUT
+	for (i = 0; i < g->m; i += 1) {
+		load.e[i].u = next_int();
+		load.e[i].v = next_int();
+		load.e[i].c = next_int();
+	}
+#endif
+
+	if (pthread_barrier_init(&load.barrier, NULL, nThreads) != 0)
+		error("load pthread_barrier_init failed");
+
+	args = xcalloc(nThreads, sizeof(load_arg_t));
+	thread = xcalloc(nThreads, sizeof(pthread_t));
+
+	for (i = 0; i < nThreads; i += 1) {
+		args[i].load = &load;
+		args[i].index = i;
+		start_thread(&thread[i], i, load_work, &args[i]);
+	}
+
+	for (i = 0; i < nThreads; i += 1)
+		pthread_join(thread[i], NULL);
+
+	pthread_barrier_destroy(&load.barrier);
+
+	g->first[g->n] = 2 * g->m;
+
+	free(load.next);
+	free(load.e);
+	free(load.sum);
+	free(load.count);
+	free(args);
+	free(thread);
+}
+
+static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
+{
+	graph_t*	g;
 
 	g = xmalloc(sizeof(graph_t));
 
 	g->n = n;
 	g->m = m;
+	g->nThreads = nThreads;
   g->done = 0;
-
-	g->v = xcalloc(n, sizeof(node_t));
-	g->e = xcalloc(m, sizeof(edge_t));
+	g->cursor = 0;
+	g->weight = 0;
+	g->taken = 0;
+	g->rounds = 0;
+	g->imbalance = 0;
+	g->worst = 0;
+
+	g->v = big_alloc(n, sizeof(node_t));
+#if SPLIT_NODES
+	g->h = big_alloc(n, sizeof(int));
+	g->e = big_alloc(n, sizeof(int));
+	g->flags = big_alloc(n, sizeof(char));
+#endif
+	g->first = big_alloc(n + 1, sizeof(int));
+	g->arc = big_alloc(2 * (size_t) m, sizeof(arc_t));
 
 	g->s = &g->v[0];
 	g->t = &g->v[n-1];
 	g->excess = NULL;
+	g->queue = NULL;
+	g->work = 0;
 
-	for (i = 0; i < m; i += 1) {
-		a = next_int();
-		b = next_int();
-		c = next_int();
-		u = &g->v[a];
-		v = &g->v[b];
-		connect(u, v, c, g->e+i);
-	}
+	if (placement == PLACE_FIRST_TOUCH)
+		g->block = sysconf(_SC_PAGESIZE) / sizeof(int);
+	else
+		g->block = CACHE_LINE / sizeof(int);
+
+	load_graph(g, nThreads);
 
   g->pushes = xcalloc(nThreads, sizeof(push_list_t*));
   for (int i = 0; i < nThreads; i++){
-    g->pushes[i] = xmalloc(sizeof(push_list_t));
+    g->pushes[i] = xaligned(sizeof(push_list_t));
     g->pushes[i]->c = 8;
     g->pushes[i]->a = malloc(g->pushes[i]->c * sizeof(push_t));
     if(g->pushes[i]->a == NULL) error("no memory");
@@ -437,22 +1054,21 @@ static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
 
   g->relabels = xcalloc(nThreads, sizeof(node_list_t*));
   for (int i = 0; i < nThreads; i++){
-    g->relabels[i] = xmalloc(sizeof(node_list_t));
+    g->relabels[i] = xaligned(sizeof(node_list_t));
     g->relabels[i]->c = 8;
     g->relabels[i]->a = malloc(g->relabels[i]->c * sizeof(push_t));
     if(g->relabels[i]->a == NULL) error("no memory");
     g->relabels[i]->i = 0;
   }
 
-  g->workList = xmalloc(sizeof(node_list_t));
+  g->workList = xaligned(sizeof(node_list_t));
   g->workList->c = 8;
-  g->workList->a = malloc(c * sizeof(push_t));
+  g->workList->a = malloc(g->workList->c * sizeof(node_t*));
   if(g->workList->a == NULL) error("no memory");
-  g->workList->a = malloc(c * sizeof(push_t));
   g->workList->i = 0;
 
-  if(pthread_barrier_init(&g->barrier, NULL, nThreads + 1) != 0) //nThreads+1 because of main thread
-    error("g pthread_barrier_init failed");
+  if(barrier_init(&g->barrier, nThreads + 1) != 0) //nThreads+1 because of main thread
+    error("g barrier_init failed, is PREFLOW_BARRIER pthread, spin or futex?");
   if(pthread_mutex_init(&g->mutex, NULL) != 0)
     error("g pthread_mutex_init failed");
 
@@ -471,8 +1087,8 @@ static void enter_excess(graph_t* g, node_t* v)
 	 *
 	 */
 
-	if (v != g->t && v != g->s && !v->inExcess) {
-    v->inExcess = 1;
+	if (v != g->t && v != g->s && !IN_EXCESS(g, v)) {
+    IN_EXCESS(g, v) = 1;
 		v->next = g->excess;
 		g->excess = v;
 	}
@@ -490,41 +1106,39 @@ static node_t* leave_excess(graph_t* g)
 	v = g->excess;
 
 	if (v != NULL) {
-    v->inExcess = 0;
+    IN_EXCESS(g, v) = 0;
 		g->excess = v->next;
-    assert(v->e > 0);
+    assert(E(g, v) > 0);
   }
 
 	return v;
 }
 
-static void push(graph_t* g, node_t* u, node_t* v, edge_t* e, int d)
+static void push(graph_t* g, node_t* u, node_t* v, int d)
 {
 	//int		d;	/* remaining capacity of the edge. */
 
 	pr("push from %d to %d: ", id(g, u), id(g, v));
-	pr("f = %d, c = %d, so ", e->f, e->c);
 
 	pr("pushing %d\n", d);
 
-	//u->e -= d; //Move this to add_push
-  pr("push changing excess node:%d, e=%d, d=%d\n", id(g,v), v->e, d);
-	v->e += d;
+	//E(g, u) -= d; //Move this to add_push
+  pr("push changing excess node:%d, e=%d, d=%d\n", id(g,v), E(g, v), d);
+	E(g, v) += d;
 
 	/* the following are always true. */
 
 	assert(d > 0);
-	assert(u->e >= 0);
-	assert(abs(e->f) <= e->c);
+	assert(E(g, u) >= 0);
 
-	if (u->e > 0) {
+	if (E(g, u) > 0) {
 
 		/* still some remaining so let u push more. */
 
     enter_excess(g, u);
 	}
 
-	if (v->e == d) {
+	if (E(g, v) == d) {
 
 		/* since v has d excess now it had zero before and
 		 * can now push.
@@ -536,139 +1150,299 @@ static void push(graph_t* g, node_t* u, node_t* v, edge_t* e, int d)
 
 static void relabel(graph_t* g, node_t* u)
 {
-	u->h += 1;
+	H(g, u) += 1;
 
-	pr("relabel %d now h = %d\n", id(g, u), u->h);
+	pr("relabel %d now h = %d\n", id(g, u), H(g, u));
 
   enter_excess(g, u);
 }
 
-static node_t* other(node_t* u, edge_t* e)
+static int search(graph_t* g, int i, int k, int unseen)
 {
-	if (u == e->u)
-		return e->v;
-	else
-		return e->u;
-}
-
-static int areWeDone(graph_t* g) {
-  node_t* source = g->s;
-  int sourceFlow = 0;
-  edge_t* e;
-  list_t* p = source->edge;
-  while (p != NULL) {
-    e = p->edge;
-    p = p->next;
-    if(source == e->u){
-      sourceFlow += e->f;
-    } else {
-      sourceFlow -= e->f;
-    }
-  }
+	node_t*		u;
+	node_t*		w;
+	arc_t*		arc;
+	int		a;
+	int		end;
+
+	/* continue the breadth first search with the nodes in
+	 * queue[i] to queue[k - 1], through arcs to them with
+	 * residual capacity, and give the nodes found the height
+	 * of the node they were found from plus one. return how
+	 * many nodes are in the queue now.
+	 *
+	 */
+
+	arc = g->arc;
+
+	while (i < k) {
+		u = &g->v[g->queue[i++]];
+		end = g->first[id(g, u) + 1];
+
+		for (a = g->first[id(g, u)]; a < end; a += 1) {
+			w = &g->v[arc[a].v];
+			if (H(g, w) == unseen && arc[arc[a].rev].r > 0) {
+				H(g, w) = H(g, u) + 1;
+				g->queue[k++] = arc[a].v;
+			}
+		}
+	}
+
+	return k;
+}
+
+static void global_relabel(graph_t* g)
+{
+	int		unseen;
+	int		i;
+	int		k;
+
+	/* as in lab0: give every node its distance to t through arcs
+	 * with residual capacity, or n plus its distance to s if it
+	 * cannot reach t, and 2n - 1 if it can reach neither and so
+	 * never will have excess.
+	 *
+	 * this is done by the main thread between the two barriers,
+	 * when no worker looks at the heights. the set of nodes with
+	 * excess does not depend on the heights so it is kept.
+	 *
+	 */
+
+	unseen = 2 * g->n - 1;
+
+	for (i = 0; i < g->n; i += 1)
+		H(g, &g->v[i]) = unseen;
+
+	H(g, g->t) = 0;
+	g->queue[0] = id(g, g->t);
+	H(g, g->s) = g->n;
+	k = search(g, 0, 1, unseen);
+
+	g->queue[k] = id(g, g->s);
+	search(g, k, k + 1, unseen);
+
+	g->work = 0;
+}
+
+static int take_chunk(graph_t* g, work_arg_t* args, int* start, int* end)
+{
+	node_list_t*	list;
+	long		target;
+	long		w;
+	int		n;
+	int		i;
+	int		j;
+
+	/* give the thread of args the next part of the work list,
+	 * start to end - 1, or return 0 when there is nothing left.
+	 *
+	 *	SCHEDULE_STATIC		each thread takes one slice of
+	 *				the same length. a thread with a
+	 *				few nodes of high degree then
+	 *				holds up everyone at the barrier.
+	 *
+	 *	SCHEDULE_DYNAMIC	the threads take chunks from a
+	 *				shared cursor as they finish the
+	 *				previous one. a chunk is what is
+	 *				left divided by 2 * nThreads, but
+	 *				at least GRAIN nodes, so chunks
+	 *				are large at first and small at
+	 *				the end of the round.
+	 *
+	 *	SCHEDULE_DEGREE		as SCHEDULE_DYNAMIC but what is
+	 *				left and the size of a chunk are
+	 *				measured in arcs, since that is
+	 *				what it takes to look at a node.
+	 *
+	 * the cursor is moved with compare and swap since the end of
+	 * the chunk depends on where it starts.
+	 *
+	 */
+
+	list = g->workList;
+	n = list->i;
+
+	if (schedule == SCHEDULE_STATIC) {
+		if (args->taken)
+			return 0;
+		args->taken = 1;
+		j = (n + (args->nThreads - 1)) / args->nThreads + 1;
+		*start = MIN(j * args->index, n);
+		*end = MIN(j * (args->index + 1), n);
+		return *start < *end;
+	}
+
+	i = __atomic_load_n(&g->cursor, __ATOMIC_RELAXED);
+	w = 0;
+
+	do {
+		if (i >= n)
+			return 0;
+
+		if (schedule == SCHEDULE_DYNAMIC)
+			j = MIN(i + MAX((n - i) / (2 * args->nThreads), GRAIN), n);
+		else {
+			target = g->weight - __atomic_load_n(&g->taken, __ATOMIC_RELAXED);
+			target = MAX(target / (2 * args->nThreads), GRAIN_ARCS);
+			for (j = i, w = 0; j < n && w < target; j += 1)
+				w += degree(g, list->a[j]) + 1;
+		}
+	} while (!__atomic_compare_exchange_n(&g->cursor, &i, j, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (schedule == SCHEDULE_DEGREE)
+		__atomic_fetch_add(&g->taken, w, __ATOMIC_RELAXED);
 
-  return sourceFlow == g->t->e;
+	*start = i;
+	*end = j;
+
+	return 1;
 }
 
 static void* work(void* argsIn) {
   work_arg_t* args = (work_arg_t*) argsIn;
   graph_t* g       = args->g;
   int index        = args->index;
-  int nThreads     = args->nThreads;
   node_t*    u;
   node_t*    v;
-  edge_t*    e;
-  list_t*    p;
-  int        b;
+  arc_t*     a;
   int        hasPushed = 0;
+  int        start;
+  int        end;
+  int        j;
 
   int        nodesProcessed = 0;
   while(!g->done){
-    int numberOfWorks = (g->workList->i + (nThreads - 1))/nThreads + 1;
-    int start = numberOfWorks*index;
-    int end = numberOfWorks*(index+1);
-    for(int i = start; i < end && i < g->workList->i; i++) {
-      u = g->workList->a[i];
-
-      /* u is any node with excess preflow. */
-
-      pr("Thread %d takes node %d from excess list\n", index, id(g, u));
-      pr("with h = %d and e = %d\n", u->h, u->e);
-      assert(u->e > 0);
-
-      /* if we can push we must push and only if we could
-       * not push anything, we are allowed to relabel.
-       *
-       * we can push to multiple nodes if we wish but
-       * here we just push once for simplicity.
-       *
-       */
-
-      hasPushed = 0;
-      v = NULL;
-      p = u->edge;
-
-      while (p != NULL && u->e > 0) {
-        e = p->edge;
-        p = p->next;
-        if (u == e->u) {
-          v = e->v;
-          b = 1;
-        } else {
-          v = e->u;
-          b = -1;
+    args->taken = 0;
+    while (take_chunk(g, args, &start, &end)) {
+      for(int i = start; i < end; i++) {
+        u = g->workList->a[i];
+
+        /* u is any node with excess preflow. */
+
+        pr("Thread %d takes node %d from excess list\n", index, id(g, u));
+        pr("with h = %d and e = %d\n", H(g, u), E(g, u));
+        assert(E(g, u) > 0);
+
+        /* if we can push we must push and only if we could
+         * not push anything, we are allowed to relabel.
+         *
+         * we can push to multiple nodes if we wish but
+         * here we just push once for simplicity.
+         *
+         */
+
+        hasPushed = 0;
+        v = NULL;
+
+        for (j = g->first[id(g, u)]; j < g->first[id(g, u) + 1] && E(g, u) > 0; j++) {
+          a = &g->arc[j];
+          v = &g->v[a->v];
+
+          if (H(g, u) > H(g, v) && a->r > 0) {
+            hasPushed = 1;
+            pr("Thread %d creates push, %d->%d\n", index, id(g,u),id(g,v));
+            add_push(g, u, v, j, index);
+          } else
+            v = NULL;
         }
+        nodesProcessed++;
+        args->load += j - g->first[id(g, u)] + 1;
 
-        if (u->h > v->h && b * e->f < e->c) {
-          hasPushed = 1;
-          pr("Thread %d creates push, %d->%d\n", index, id(g,u),id(g,v));
-          add_push(g, u, v, e, index);
-        } else
-          v = NULL;
-      }
-      nodesProcessed++;
+        if(!hasPushed) {
+          pr("Adding node %d to relabel list\n", id(g,u));
+          add_relabel(g, u, index);
+          //g->relabelLists[index] = add_node(g->relabelLists[index], u);
+        }
 
-      if(!hasPushed) {
-        pr("Adding node %d to relabel list\n", id(g,u));
-        add_relabel(g, u, index);
-        //g->relabelLists[index] = add_node(g->relabelLists[index], u);
+        //if (v != NULL) {
+        //  push(g, u, v, e);
+        //} else
+        //  relabel(g, u);
       }
-
-      //if (v != NULL) {
-      //  push(g, u, v, e);
-      //} else
-      //  relabel(g, u);
     }
     pr("Thread %d waiting at barrier 1\n", index);
-    pthread_barrier_wait(&g->barrier); //Tell main thread our pushList is ready
+    barrier_wait(&g->barrier); //Tell main thread our pushList is ready
     pr("Thread %d waiting at barrier 2\n", index);
-    pthread_barrier_wait(&g->barrier); //Wait for main thread to finish processing
+    barrier_wait(&g->barrier); //Wait for main thread to finish processing
   }
   printf("Thread exited, %d nodes processed\n", nodesProcessed);
+  return NULL;
+}
+
+static void balance(graph_t* g, work_arg_t* args, int nThreads)
+{
+	double		ratio;
+	long		max;
+	long		sum;
+	int		i;
+
+	/* the load of a round is what the busiest thread did compared
+	 * with the mean, i.e. 1 when all did the same and nThreads when
+	 * one did everything while the others waited at the barrier.
+	 *
+	 */
+
+	for (i = max = sum = 0; i < nThreads; i += 1) {
+		max = MAX(max, args[i].load);
+		sum += args[i].load;
+		args[i].load = 0;
+	}
+
+	if (sum == 0)
+		return;
+
+	ratio = (double) max * nThreads / sum;
+	g->rounds += 1;
+	g->imbalance += ratio;
+	g->worst = MAX(g->worst, ratio);
 }
 
 static void divideWork(graph_t* g, int nThreads) {
   node_t* u;
   g->workList->i = 0;
+  g->weight = 0;
+  g->cursor = 0;
+  g->taken = 0;
   while ((u = leave_excess(g)) != NULL) {
-    assert(u->e > 0);
-    pr("Add node %d to workList with e=%d\n", id(g,u), u->e);
+    assert(E(g, u) > 0);
+    if (g->phase == 1 && H(g, u) >= g->n)
+      continue;	/* waits for phase 2, see preflow. */
+    pr("Add node %d to workList with e=%d\n", id(g,u), E(g, u));
     add_work(g, u);
   }
 }
 
-static int preflow(graph_t* g, int nThreads)
+static int preflow(graph_t* g, int nThreads, double alpha, int phases)
 {
 	node_t*		s;
 	node_t*		u;
-	node_t*		v;
-	edge_t*		e;
-	list_t*		p;
-	int		b;
+	arc_t*		a;
+	long		limit;
 
 	s = g->s;
-	s->h = g->n;
+	H(g, s) = g->n;
 
-	p = s->edge;
+	/* the main thread does a global_relabel when the pushes and
+	 * relabels done since the last one are more than alpha * n + m
+	 * as in lab0, where a relabel of u counts as its arcs.
+	 *
+	 */
+
+	limit = alpha * g->n + g->m;
+
+	if (alpha > 0)
+		g->queue = xmalloc(g->n * sizeof(int));
+
+	/* phase 1 stops when every node with excess is at n or above,
+	 * i.e. cannot reach t. then the excess of t is the maximum flow.
+	 * phase 2, if phases is 2, pushes their excess back to s so that
+	 * we end with a flow. in phase 1 divideWork leaves nodes at n or
+	 * above out of the work list, and phase 2 puts them back.
+	 *
+	 */
+
+	g->phase = 1;
 
 	/* start by pushing as much as possible (limited by
 	 * the edge capacity) from the source to its neighbors.
@@ -676,21 +1450,21 @@ static int preflow(graph_t* g, int nThreads)
 	 */
 
   int d;
-	while (p != NULL) {
-		e = p->edge;
-		p = p->next;
-
-		s->e += e->c;
-    if (s == e->u) {
-      d = MIN(s->e, e->c - e->f);
-      e->f += d;
-    } else {
-      d = MIN(s->e, e->c + e->f);
-      e->f -= d;
-    }
-		push(g, s, other(s, e), e, d);
+	for (int i = g->first[id(g, s)]; i < g->first[id(g, s) + 1]; i++) {
+		a = &g->arc[i];
+		d = a->r;
+		if (d == 0)
+			continue;
+
+		E(g, s) += d;
+		a->r -= d;
+		g->arc[a->rev].r += d;
+		push(g, s, &g->v[a->v], d);
 	}
 
+	if (alpha > 0)
+		global_relabel(g);
+
   divideWork(g, nThreads);
 
   work_arg_t* args = xcalloc(nThreads, sizeof(work_arg_t));
@@ -701,32 +1475,49 @@ static int preflow(graph_t* g, int nThreads)
     args[i].index = i;
     args[i].g = g;
     args[i].nThreads = nThreads;
-    if (pthread_create(&thread[i], NULL, work, (void*) &args[i]) != 0)
-      error("pthread_create failed");
+    start_thread(&thread[i], i, work, &args[i]);
   }
 
   while(!g->done) {
-    pthread_barrier_wait(&g->barrier); //Wait for threads to finish their pushlists
+    barrier_wait(&g->barrier); //Wait for threads to finish their pushlists
+    balance(g, args, nThreads);
     for(int i = 0; i < nThreads; i++) {
       for(int j = 0; j < g->pushes[i]->i; j++){
         push_t p = g->pushes[i]->a[j];
-        push(g, p.u, p.v, p.e, p.d);
+        push(g, p.u, p.v, p.d);
       }
+      g->work += g->pushes[i]->i;
       g->pushes[i]->i = 0;
     }
     for(int i = 0; i < nThreads; i++) {
       for(int j = 0; j < g->relabels[i]->i; j++){
-        relabel(g, g->relabels[i]->a[j]);
+        u = g->relabels[i]->a[j];
+        relabel(g, u);
+        g->work += g->first[id(g, u) + 1] - g->first[id(g, u)] + 12;
       }
       g->relabels[i]->i = 0;
     }
-    g->done = areWeDone(g);
+    if (alpha > 0 && g->work > limit)
+      global_relabel(g);
     divideWork(g, nThreads);
-    pthread_barrier_wait(&g->barrier); // Let threads start making new pushlists
+    if (g->workList->i == 0 && g->phase == 1 && phases == 2) {
+      g->phase = 2;
+      for (int i = 0; i < g->n; i++)
+        if (E(g, &g->v[i]) > 0)
+          enter_excess(g, &g->v[i]);
+      divideWork(g, nThreads);
+    }
+    g->done = g->workList->i == 0;
+    barrier_wait(&g->barrier); // Let threads start making new pushlists
   }
 
   pr("Program done!");
 
+  if (stats)
+    fprintf(stderr, "%s: %d rounds, load imbalance %.2f mean %.2f worst\n",
+      progname, g->rounds, g->rounds > 0 ? g->imbalance / g->rounds : 1.0,
+      MAX(g->worst, 1.0));
+
   // Kill threads
   for (int i = 0; i < nThreads; i++){
     pthread_join(thread[i], NULL);
@@ -734,25 +1525,262 @@ static int preflow(graph_t* g, int nThreads)
     //  error("pthread_create failed");
   }
 
-	return g->t->e;
+	return E(g, g->t);
 }
 
-static void free_graph(graph_t* g)
+static int owner(graph_t* g, node_t* u)
+{
+	/* the thread that discharges u in the atomic engine. blocks
+	 * of nodes whose heights fill a cache block are dealt out in
+	 * turn, so a thread writes the heights of its own blocks only.
+	 * with PLACE_FIRST_TOUCH a block fills a page instead, so that
+	 * the loader can put the pages of a block next to its owner.
+	 *
+	 */
+
+	return id(g, u) / g->block % g->nThreads;
+}
+
+static void enter_inbox(graph_t* g, node_t* v)
 {
+	inbox_t*	inbox;
+
+	/* give v to its owner. any thread can do this at any time so
+	 * the inbox is a stack where v is put on top with compare and
+	 * swap, which fails and is tried again if some other thread
+	 * changed the top after we read it. the owner takes the whole
+	 * stack at once with an exchange so a node never is taken by
+	 * one thread while another thread reads its next.
+	 *
+	 */
+
+	inbox = &g->inbox[owner(g, v)];
+	v->next = __atomic_load_n(&inbox->head, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&inbox->head, &v->next, v,
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+static void atomic_discharge(graph_t* g, node_t* u)
+{
+	node_t*		v;
+	arc_t*		arc;
+	int		a;
+	int		b;
+	int		end;
+	int		e;
+	int		d;
+	int		r;
+	int		h;
+	int		min;
+
+	/* the lock-free push-relabel of Hong. only the owner of u
+	 * changes the height of u, takes excess from u and takes
+	 * residual capacity from the arcs of u, but everyone can give
+	 * u excess and give its arcs residual capacity back when they
+	 * push to u. so what we read of these is a lower bound that
+	 * stays true while we look, and the heights of the neighbours
+	 * are read without any ordering since they only grow and a
+	 * stale height is just lower.
+	 *
+	 * we push to the lowest neighbour through an arc with residual
+	 * capacity if u is higher, and otherwise relabel u to one
+	 * above it. there is no barrier and no main thread applying
+	 * pushes: the flow moves with atomic adds as we go.
+	 *
+	 */
+
+	arc = g->arc;
+	end = g->first[id(g, u) + 1];
+	e = __atomic_load_n(&E(g, u), __ATOMIC_ACQUIRE);
+
+	while (e > 0) {
+		min = INT32_MAX;
+		b = -1;
+
+		for (a = g->first[id(g, u)]; a < end; a += 1) {
+			if (__atomic_load_n(&arc[a].r, __ATOMIC_RELAXED) == 0)
+				continue;
+
+			h = __atomic_load_n(&H(g, &g->v[arc[a].v]), __ATOMIC_RELAXED);
+
+			if (h < min) {
+				min = h;
+				b = a;
+			}
+		}
+
+		/* a node with excess got it through some arc which
+		 * then has residual capacity back.
+		 *
+		 */
+
+		assert(b >= 0);
+
+		if (H(g, u) <= min) {
+			__atomic_store_n(&H(g, u), min + 1, __ATOMIC_RELAXED);
+
+			if (g->phases == 1 && min + 1 >= g->n) {
+
+				/* u cannot reach t, see preflow. */
+
+				__atomic_fetch_sub(&g->active, 1, __ATOMIC_RELEASE);
+				return;
+			}
+
+			continue;
+		}
+
+		v = &g->v[arc[b].v];
+		r = __atomic_load_n(&arc[b].r, __ATOMIC_RELAXED);
+		d = MIN(e, r);
+
+		__atomic_fetch_sub(&arc[b].r, d, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&arc[arc[b].rev].r, d, __ATOMIC_RELAXED);
+
+		/* v is counted as active before u can stop being so, so
+		 * the count is zero only when everyone is done.
+		 *
+		 */
+
+		if (__atomic_fetch_add(&E(g, v), d, __ATOMIC_ACQ_REL) == 0
+			&& v != g->s && v != g->t) {
+			__atomic_fetch_add(&g->active, 1, __ATOMIC_RELAXED);
+			enter_inbox(g, v);
+		}
+
+		e = __atomic_sub_fetch(&E(g, u), d, __ATOMIC_ACQ_REL);
+	}
+
+	__atomic_fetch_sub(&g->active, 1, __ATOMIC_RELEASE);
+}
+
+static void* atomic_work(void* arg)
+{
+	work_arg_t*	args = arg;
+	graph_t*	g = args->g;
+	inbox_t*	inbox = &g->inbox[args->index];
+	node_t*		list;
+	node_t*		u;
+
+	/* discharge the nodes given to us until no node anywhere has
+	 * excess left to discharge.
+	 *
+	 */
+
+	list = NULL;
+
+	while (__atomic_load_n(&g->active, __ATOMIC_ACQUIRE) > 0) {
+		if (list == NULL) {
+			list = __atomic_exchange_n(&inbox->head, NULL, __ATOMIC_ACQUIRE);
+
+			/* let a thread with work have the core if there
+			 * are more threads than cores.
+			 *
+			 */
+
+			if (list == NULL) {
+				sched_yield();
+				continue;
+			}
+		}
+
+		u = list;
+		list = u->next;
+		atomic_discharge(g, u);
+	}
+
+	return NULL;
+}
+
+static int atomic_preflow(graph_t* g, int nThreads, double alpha, int phases)
+{
+	node_t*		s;
+	node_t*		u;
+	arc_t*		a;
+	pthread_t*	thread;
+	work_arg_t*	args;
 	int		i;
-	list_t*		p;
-	list_t*		q;
+	int		d;
+
+	/* the same preflow as the barrier engine computes, but each
+	 * thread owns some nodes (see owner) and discharges them as
+	 * soon as they get excess, with the atomic pushes and relabels
+	 * of atomic_discharge. a node that gets excess from zero is
+	 * put in the inbox of its owner by whoever pushed to it.
+	 *
+	 * the heights can only be recomputed from t before the threads
+	 * start since a global_relabel needs everyone to stop. in phase
+	 * 1 a node that reaches n stops being active, and with phases
+	 * 2 it instead goes on until its excess is back at s.
+	 *
+	 */
+
+	s = g->s;
+	H(g, s) = g->n;
+	g->nThreads = nThreads;
+	g->phases = phases;
+	g->active = 0;
+	g->inbox = xaligned(nThreads * sizeof(inbox_t));
+
+	for (i = 0; i < nThreads; i += 1)
+		g->inbox[i].head = NULL;
+
+	for (i = g->first[id(g, s)]; i < g->first[id(g, s) + 1]; i += 1) {
+		a = &g->arc[i];
+		d = a->r;
+		a->r -= d;
+		g->arc[a->rev].r += d;
+		E(g, &g->v[a->v]) += d;
+	}
+
+	if (alpha > 0) {
+		g->queue = xmalloc(g->n * sizeof(int));
+		global_relabel(g);
+	}
 
 	for (i = 0; i < g->n; i += 1) {
-		p = g->v[i].edge;
-		while (p != NULL) {
-			q = p->next;
-			free(p);
-			p = q;
-		}
+		u = &g->v[i];
+		if (u == s || u == g->t || E(g, u) == 0)
+			continue;
+		if (phases == 1 && H(g, u) >= g->n)
+			continue;
+		g->active += 1;
+		enter_inbox(g, u);
+	}
+
+	args = xcalloc(nThreads, sizeof(work_arg_t));
+	thread = xmalloc(nThreads * sizeof(pthread_t));
+
+	for (i = 0; i < nThreads; i += 1) {
+		args[i].index = i;
+		args[i].g = g;
+		args[i].nThreads = nThreads;
+		start_thread(&thread[i], i, atomic_work, &args[i]);
 	}
-	free(g->v);
-	free(g->e);
+
+	for (i = 0; i < nThreads; i += 1)
+		pthread_join(thread[i], NULL);
+
+	free(thread);
+	free(args);
+	free(g->inbox);
+
+	return E(g, g->t);
+}
+
+static void free_graph(graph_t* g)
+{
+	big_free(g->first);
+	big_free(g->arc);
+#if SPLIT_NODES
+	big_free(g->h);
+	big_free(g->e);
+	big_free(g->flags);
+#endif
+	big_free(g->v);
+	free(g->queue);
 	free(g);
 }
 
@@ -763,12 +1791,61 @@ int main(int argc, char* argv[])
 	int		f;	/* output from preflow.		*/
 	int		n;	/* number of nodes.		*/
 	int		m;	/* number of edges.		*/
-  int   nThreads = 4;
+  int   nThreads = thread_count();
+	double		alpha;	/* how often to global_relabel.	*/
+	int		phases;	/* 2 to make a flow of the preflow.	*/
+	int		engine;	/* barrier rounds or lock-free.	*/
+	int		c;
 
 	progname = argv[0];	/* name is a string in argv[0]. */
 
+	alpha = 6;
+	phases = 1;
+	engine = ENGINE_ATOMIC;
+
+	while ((c = getopt(argc, argv, "a:e:fg:p:t:vw:")) != -1) {
+		if (c == 'a' && strcmp(optarg, "default") == 0)
+			placement = PLACE_DEFAULT;
+		else if (c == 'a' && strcmp(optarg, "interleave") == 0)
+			placement = PLACE_INTERLEAVE;
+		else if (c == 'a' && strcmp(optarg, "firsttouch") == 0)
+			placement = PLACE_FIRST_TOUCH;
+		else if (c == 'e' && strcmp(optarg, "barrier") == 0)
+			engine = ENGINE_BARRIER;
+		else if (c == 'e' && strcmp(optarg, "atomic") == 0)
+			engine = ENGINE_ATOMIC;
+		else if (c == 'p' && strcmp(optarg, "normal") == 0)
+			pages = PAGES_NORMAL;
+		else if (c == 'p' && strcmp(optarg, "thp") == 0)
+			pages = PAGES_THP;
+		else if (c == 'p' && strcmp(optarg, "hugetlb") == 0)
+			pages = PAGES_HUGETLB;
+		else if (c == 'w' && strcmp(optarg, "static") == 0)
+			schedule = SCHEDULE_STATIC;
+		else if (c == 'w' && strcmp(optarg, "dynamic") == 0)
+			schedule = SCHEDULE_DYNAMIC;
+		else if (c == 'w' && strcmp(optarg, "degree") == 0)
+			schedule = SCHEDULE_DEGREE;
+		else if (c == 'v')
+			stats = 1;
+		else if (c == 't' && (nThreads = atoi(optarg)) > 0)
+			;
+		else if (c == 'g' && (alpha = atof(optarg)) >= 0)
+			;
+		else if (c == 'f')
+			phases = 2;
+		else
+			error("usage: %s [-a default|interleave|firsttouch] [-e barrier|atomic] [-f] [-g alpha] [-p normal|thp|hugetlb] [-t threads] [-v] [-w static|dynamic|degree] < graph", progname);
+	}
+
+	numa_nodes = count_numa_nodes();
+
 	in = stdin;		/* same as System.in in Java.	*/
 
+#if MMAP_INPUT
+	open_input(&input, fileno(in));
+#endif
+
 	n = next_int();
 	m = next_int();
 
@@ -778,9 +1855,19 @@ int main(int argc, char* argv[])
 
 	g = new_graph(in, n, m, nThreads);
 
+	if (placement != PLACE_DEFAULT || pages != PAGES_NORMAL)
+		report_placement();
+
+#if MMAP_INPUT
+	close_input(&input);
+#endif
+
 	fclose(in);
 
-	f = preflow(g, nThreads);
+	if (engine == ENGINE_ATOMIC)
+		f = atomic_preflow(g, nThreads, alpha, phases);
+	else
+		f = preflow(g, nThreads, alpha, phases);
 
 	printf("f = %d\n", f);
 
@@ -6,6 +6,8 @@ use std::cmp;
 use std::thread;
 use std::process::exit;
 use std::collections::VecDeque;
+use std::env;
+use std::fs;
 
 const DEBUG: bool = false;
 
@@ -98,6 +100,116 @@ fn are_we_done(nodes: &Vec<Arc<Mutex<Node>>>, n: usize) -> bool {
     return t_node.e == -s_node.e;
 }
 
+/* PREFLOW_THREADS if it is set, and otherwise one thread for each
+ * CPU we may run on.
+ */
+fn thread_count() -> usize {
+    match env::var("PREFLOW_THREADS") {
+        Ok(ref s) if !s.is_empty() => match s.parse::<usize>() {
+            Ok(n) if n > 0 => n,
+            _ => {
+                eprintln!("PREFLOW_THREADS must be at least 1, not {}", s);
+                exit(1);
+            }
+        },
+        _ => thread::available_parallelism().map(|n| n.get()).unwrap_or(1),
+    }
+}
+
+/* a cpu_set_t of glibc, with room for 1024 CPUs. */
+const CPU_WORDS: usize = 16;
+
+extern "C" {
+    fn sched_getaffinity(pid: i32, size: usize, mask: *mut u64) -> i32;
+    fn sched_setaffinity(pid: i32, size: usize, mask: *const u64) -> i32;
+}
+
+fn topology(c: usize, what: &str) -> Option<usize> {
+    let name = format!("/sys/devices/system/cpu/cpu{}/topology/{}", c, what);
+    fs::read_to_string(name).ok()?.trim().parse().ok()
+}
+
+/* the CPUs of the threads from PREFLOW_AFFINITY, as in the C labs:
+ * compact puts them close together, scatter far apart, and a list
+ * such as 0,2,4-7 gives the CPUs in order. thread i runs on CPU
+ * cpus[i % cpus.len()], and an empty vector means no pinning.
+ */
+fn affinity() -> Vec<usize> {
+    let s = match env::var("PREFLOW_AFFINITY") {
+        Ok(s) => s,
+        Err(_) => return vec![],
+    };
+    let mut cpus = vec![];
+
+    if s.is_empty() || s == "none" {
+        return cpus;
+    }
+
+    if s == "compact" || s == "scatter" {
+        let mut mask = [0u64; CPU_WORDS];
+        if unsafe { sched_getaffinity(0, 8 * CPU_WORDS, mask.as_mut_ptr()) } != 0 {
+            eprintln!("sched_getaffinity failed");
+            exit(1);
+        }
+
+        let mut found: Vec<(usize, usize)> = vec![];	/* package and core. */
+        let mut keys: Vec<((usize, usize, usize), usize)> = vec![];
+        for c in 0 .. 64 * CPU_WORDS {
+            if mask[c / 64] & (1 << (c % 64)) == 0 {
+                continue;
+            }
+            let package = topology(c, "physical_package_id").unwrap_or(0);
+            let core = topology(c, "core_id").unwrap_or(c);
+            let rank = found.iter().filter(|&&pc| pc == (package, core)).count();
+            found.push((package, core));
+            if s == "compact" {
+                keys.push(((package, core, rank), c));
+            } else {
+                keys.push(((rank, core, package), c));
+            }
+        }
+        keys.sort();
+        return keys.iter().map(|k| k.1).collect();
+    }
+
+    for part in s.split(',').filter(|p| !p.is_empty()) {
+        let mut ends = part.splitn(2, '-').map(|x| x.parse::<usize>());
+        let a = ends.next();
+        let b = ends.next();
+        match (a, b) {
+            (Some(Ok(a)), None) => cpus.push(a),
+            (Some(Ok(a)), Some(Ok(b))) if a <= b => cpus.extend(a ..= b),
+            _ => {
+                eprintln!("PREFLOW_AFFINITY should be compact, scatter or a list such as 0,2,4-7, not {}", s);
+                exit(1);
+            }
+        }
+    }
+
+    cpus
+}
+
+/* run the calling thread, number i, on its CPU. */
+fn pin(cpus: &Vec<usize>, i: usize) {
+    if cpus.is_empty() {
+        return;
+    }
+
+    let c = cpus[i % cpus.len()];
+    let mut mask = [0u64; CPU_WORDS];
+
+    if c >= 64 * CPU_WORDS {
+        eprintln!("cannot run thread {} on CPU {}", i, c);
+        exit(1);
+    }
+
+    mask[c / 64] |= 1 << (c % 64);
+
+    if unsafe { sched_setaffinity(0, 8 * CPU_WORDS, mask.as_ptr()) } != 0 {
+        eprintln!("cannot run thread {} on CPU {}", i, c);
+        exit(1);
+    }
+}
 
 fn main() {
 
@@ -111,7 +223,8 @@ fn main() {
 	//let mut excess: BlockingQueue<usize> = BlockingQueue::new();
     let excess = Arc::new(ExcessQueue::new());
 	let debug = false;
-    let num_threads = 4;
+    let num_threads = thread_count();
+    let cpus = affinity();
 
 	let s = 0;
 	let t = n-1;
@@ -191,7 +304,9 @@ fn main() {
         let mut nodes_l = nodes.clone();
         let adj_l = adj.clone();
         let edges_l = edges.clone();
+        let cpus_l = cpus.clone();
 		let h = thread::spawn(move || {
+            pin(&cpus_l, index - 1);
             loop {
                 pr!("Thread {} enters leave_excess", index);
                 let u = leave_excess(&mut excess_l, &mut nodes_l, n);
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE	/* for sched_getaffinity and CPU_COUNT. */
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "barrier.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define relax()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define relax()		__asm__ __volatile__("yield")
+#else
+#define relax()		do { } while (0)
+#endif
+
+#define POLLS		64	/* reads of sense between clock reads. */
+
+static long now(void)
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void sleep_on(unsigned* p, unsigned value)
+{
+#ifdef __linux__
+	/* the kernel checks *p == value before it puts us to sleep,
+	 * so a flip after our last look at sense is not lost.
+	 *
+	 */
+
+	syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+	sched_yield();
+#endif
+}
+
+static void wake_all(unsigned* p)
+{
+#ifdef __linux__
+	syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+int barrier_cpus(void)
+{
+	long		n;
+
+	/* the CPUs we may run on, as cpu_count in threads.c. */
+
+#ifdef __linux__
+	cpu_set_t	set;
+
+	if (sched_getaffinity(0, sizeof set, &set) == 0)
+		return CPU_COUNT(&set);
+#endif
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+int barrier_init_kind(barrier_t* b, unsigned count, int kind, long spin)
+{
+	if (count == 0)
+		return EINVAL;
+
+	memset(b, 0, sizeof *b);
+
+	b->kind		= kind;
+	b->count	= count;
+	b->spin		= spin;
+	b->left		= count;
+
+	if (kind == BARRIER_PTHREAD)
+		return pthread_barrier_init(&b->pthread, NULL, count);
+
+	return 0;
+}
+
+int barrier_init(barrier_t* b, unsigned count)
+{
+	char*		s;
+	int		kind;
+	long		spin;
+
+	s = getenv("PREFLOW_BARRIER");
+	kind = BARRIER_DEFAULT;
+	spin = BARRIER_SPIN_NS;
+
+	if (s == NULL || *s == 0)
+		;
+	else if (strcmp(s, "pthread") == 0)
+		kind = BARRIER_PTHREAD;
+	else if (strcmp(s, "spin") == 0)
+		kind = BARRIER_SPIN;
+	else if (strcmp(s, "futex") == 0) {
+		kind = BARRIER_SPIN;
+		spin = 0;
+	} else
+		return EINVAL;
+
+	/* with more workers than CPUs the thread we spin for may
+	 * need our CPU to get there, so go straight to the futex.
+	 * one of the count threads is the main thread, which waits
+	 * while the workers work and is left out.
+	 *
+	 */
+
+	if (count - 1 > (unsigned) barrier_cpus())
+		spin = 0;
+
+	return barrier_init_kind(b, count, kind, spin);
+}
+
+int barrier_wait(barrier_t* b)
+{
+	unsigned	sense;
+	long		deadline;
+	int		i;
+
+	if (b->kind == BARRIER_PTHREAD)
+		return pthread_barrier_wait(&b->pthread);
+
+	/* sense cannot flip before we have arrived, so this is the
+	 * value of the round we are in.
+	 *
+	 */
+
+	sense = __atomic_load_n(&b->sense, __ATOMIC_ACQUIRE);
+
+	if (__atomic_sub_fetch(&b->left, 1, __ATOMIC_ACQ_REL) == 0) {
+
+		/* the others cannot arrive at the next round before
+		 * they see the flip, so left can be reset first.
+		 *
+		 */
+
+		__atomic_store_n(&b->left, b->count, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->sense, !sense, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&b->sleepers, __ATOMIC_SEQ_CST) > 0)
+			wake_all(&b->sense);
+
+		return PTHREAD_BARRIER_SERIAL_THREAD;
+	}
+
+	if (b->spin > 0) {
+		deadline = now() + b->spin;
+		do {
+			for (i = 0; i < POLLS; i += 1) {
+				if (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != sense)
+					return 0;
+				relax();
+			}
+		} while (now() < deadline);
+	}
+
+	/* sleepers is incremented before the futex checks sense and
+	 * the last thread flips sense before it reads sleepers, so
+	 * either it sees us or the futex sees the flip.
+	 *
+	 */
+
+	while (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) == sense) {
+		__atomic_add_fetch(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+		sleep_on(&b->sense, sense);
+		__atomic_sub_fetch(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return 0;
+}
+
+void barrier_destroy(barrier_t* b)
+{
+	if (b->kind == BARRIER_PTHREAD)
+		pthread_barrier_destroy(&b->pthread);
+}
@@ -0,0 +1,253 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "input.h"
+
+#if MMAP_INPUT
+
+input_t		input;
+
+void open_input(input_t* in, int fd)
+{
+	struct stat	st;
+	size_t		n;
+	ssize_t		r;
+	void*		p;
+
+	/* make all of the input available in memory at once so that
+	 * next_int never needs to call the C library per character.
+	 *
+	 * a regular file is mapped into our address space with mmap
+	 * which means the kernel gives us its page cache pages and
+	 * nothing is copied. it is mapped private and writable so that
+	 * a graph file can be changed in place (see map_graph in lab0)
+	 * without changing the file, and only pages we write to are
+	 * copied.
+	 *
+	 * a pipe cannot be mapped so then we read it with as few and
+	 * as large read calls as we can into a buffer that we double
+	 * when it is full.
+	 *
+	 */
+
+	memset(in, 0, sizeof(input_t));
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			in->buf = p;
+			in->size = st.st_size;
+			in->end = in->buf + in->size;
+			in->p = in->buf;
+			in->mapped = 1;
+			return;
+		}
+	}
+
+	in->size = 1 << 20;
+	in->buf = malloc(in->size);
+	if (in->buf == NULL)
+		error("out of memory: malloc(%zu) failed", in->size);
+	n = 0;
+
+	for (;;) {
+		if (n == in->size) {
+			in->size *= 2;
+			in->buf = realloc(in->buf, in->size);
+			if (in->buf == NULL)
+				error("out of memory: realloc(%zu) failed", in->size);
+		}
+
+		r = read(fd, in->buf + n, in->size - n);
+
+		if (r < 0)
+			error("read failed");
+		else if (r == 0)
+			break;
+
+		n += r;
+	}
+
+	in->p = in->buf;
+	in->end = in->buf + n;
+}
+
+void close_input(input_t* in)
+{
+	if (in->mapped)
+		munmap(in->buf, in->size);
+	else
+		free(in->buf);
+
+	in->buf = in->p = in->end = NULL;
+}
+
+static inline int scan_digits(const char* p, const char* end, int* n)
+{
+	int		x;
+
+	/* the plain way: one digit at a time. used near the end of
+	 * the input and on machines without SSE2.
+	 *
+	 */
+
+	x = 0;
+	*n = 0;
+	while (p < end && isdigit(*p)) {
+		x = 10 * x + *p++ - '0';
+		*n += 1;
+	}
+
+	return x;
+}
+
+#if defined(__SSE2__)
+
+static inline uint32_t eight_digits(const char* p, int n)
+{
+	uint64_t	x;
+
+	/* for the curious: this converts n <= 8 digits to a number
+	 * without a loop, as in simdjson by Langdale and Lemire.
+	 *
+	 * on x86 the first character ends up in the lowest byte of x.
+	 * shifting left by 8 * (8 - n) throws away what follows the
+	 * digits and puts zero bytes in front, i.e. leading zeroes.
+	 * then we combine pairs of digits, pairs of pairs, and so on,
+	 * with a multiply and a shift in each step.
+	 *
+	 */
+
+	memcpy(&x, p, sizeof x);
+	x <<= 8 * (8 - n);
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	x = ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+
+	return x;
+}
+
+static inline unsigned digit_mask(const char* p)
+{
+	__m128i		x;
+	__m128i		lo;
+	__m128i		hi;
+
+	/* compare 16 characters at once with '0' and '9' and return
+	 * one bit per character which is set for the digits.
+	 *
+	 */
+
+	x = _mm_loadu_si128((const __m128i*) p);
+	lo = _mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1));
+	hi = _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1));
+
+	return _mm_movemask_epi8(_mm_and_si128(lo, hi));
+}
+
+#endif
+
+int scan_int(char** pp, const char* end)
+{
+	const char*	p;
+	int		x;
+	int		n;
+
+	/* the same as the getchar version of next_int but reading from
+	 * memory at *pp, which is moved past the number.
+	 *
+	 * with SSE2 we look at 16 characters at a time to skip the
+	 * spaces and newlines and to find how many digits the number
+	 * has, and then convert up to 8 digits without any loop.
+	 *
+	 */
+
+	p = *pp;
+
+#if defined(__SSE2__)
+	while (end - p >= 16) {
+		unsigned	mask;
+
+		mask = digit_mask(p);
+
+		if (mask == 0) {
+			p += 16;
+			continue;
+		}
+
+		p += __builtin_ctz(mask);
+
+		if (end - p < 16)
+			break;
+
+		n = __builtin_ctz(~digit_mask(p));
+
+		if (n <= 8)
+			x = eight_digits(p, n);
+		else {
+			x = eight_digits(p, 8);
+			x = x * 10 + p[8] - '0';
+			if (n == 10)
+				x = x * 10 + p[9] - '0';
+		}
+
+		*pp = (char*) p + n;
+
+		return x;
+	}
+#endif
+
+	while (p < end && !isdigit(*p))
+		p += 1;
+
+	x = scan_digits(p, end, &n);
+	*pp = (char*) p + n;
+
+	return x;
+}
+
+int next_int(void)
+{
+	return scan_int(&input.p, input.end);
+}
+
+#else
+
+int next_int(void)
+{
+        int     x;
+        int     c;
+
+	/* this is like Java's nextInt to get the next integer.
+	 *
+	 * we read the next integer one digit at a time which is
+	 * simpler and faster than using the normal function
+	 * fscanf that needs to do more work.
+	 *
+	 * we get the value of a digit character by subtracting '0'
+	 * so the character '4' gives '4' - '0' == 4
+	 *
+	 * it works like this: say the next input is 124
+	 * x is first 0, then 1, then 10 + 2, and then 120 + 4.
+	 *
+	 */
+
+	x = 0;
+        while (isdigit(c = getchar()))
+                x = 10 * x + c - '0';
+
+        return x;
+}
+
+#endif
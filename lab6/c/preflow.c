@@ -2,7 +2,7 @@
  * Goldberg and Tarjan, for the 2021 EDAN26 Multicore programming labs.
  *
  * It is intended to be as simple as possible to understand and is
- * not optimized in any way.
+ * not optimized except for reading the input, see open_input.
  *
  * You should NOT read everything for this course.
  *
@@ -33,7 +33,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <unistd.h>
+
+#include "barrier.h"
+#include "input.h"
+#include "threads.h"
 
 #define PRINT		0	/* enable/disable prints. */
 
@@ -125,7 +133,7 @@ struct graph_t {
 	node_t*		s;	/* source.			*/
 	node_t*		t;	/* sink.			*/
 	node_t*		excess;	/* nodes with e > 0 except s,t.	*/
-  pthread_barrier_t barrier;
+  barrier_t barrier;	// between the rounds, see barrier.h
   push_list_t** pushes;
   node_list_t** relabels;
   node_list_t* workList;
@@ -228,32 +236,6 @@ void error(const char* fmt, ...)
 	exit(1);
 }
 
-static int next_int()
-{
-        int     x;
-        int     c;
-
-	/* this is like Java's nextInt to get the next integer.
-	 *
-	 * we read the next integer one digit at a time which is
-	 * simpler and faster than using the normal function
-	 * fscanf that needs to do more work.
-	 *
-	 * we get the value of a digit character by subtracting '0'
-	 * so the character '4' gives '4' - '0' == 4
-	 *
-	 * it works like this: say the next input is 124
-	 * x is first 0, then 1, then 10 + 2, and then 120 + 4.
-	 *
-	 */
-
-	x = 0;
-        while (isdigit(c = getchar()))
-                x = 10 * x + c - '0';
-
-        return x;
-}
-
 static void* xmalloc(size_t s)
 {
 	void*		p;
@@ -455,8 +437,8 @@ static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
   g->workList->a = malloc(c * sizeof(push_t));
   g->workList->i = 0;
 
-  if(pthread_barrier_init(&g->barrier, NULL, nThreads + 1) != 0) //nThreads+1 because of main thread
-    error("g pthread_barrier_init failed");
+  if(barrier_init(&g->barrier, nThreads + 1) != 0) //nThreads+1 because of main thread
+    error("g barrier_init failed, is PREFLOW_BARRIER pthread, spin or futex?");
   if(pthread_mutex_init(&g->mutex, NULL) != 0)
     error("g pthread_mutex_init failed");
 
@@ -640,9 +622,9 @@ static void* work(void* argsIn) {
       //  relabel(g, u);
     }
     pr("Thread %d waiting at barrier 1\n", index);
-    pthread_barrier_wait(&g->barrier); //Tell main thread our pushList is ready
+    barrier_wait(&g->barrier); //Tell main thread our pushList is ready
     pr("Thread %d waiting at barrier 2\n", index);
-    pthread_barrier_wait(&g->barrier); //Wait for main thread to finish processing
+    barrier_wait(&g->barrier); //Wait for main thread to finish processing
   }
   printf("Thread exited, %d nodes processed\n", nodesProcessed);
 }
@@ -703,12 +685,11 @@ static int preflow(graph_t* g, int nThreads)
     args[i].index = i;
     args[i].g = g;
     args[i].nThreads = nThreads;
-    if (pthread_create(&thread[i], NULL, work, (void*) &args[i]) != 0)
-      error("pthread_create failed");
+    start_thread(&thread[i], i, work, &args[i]);
   }
 
   while(!g->done) {
-    pthread_barrier_wait(&g->barrier); //Wait for threads to finish their pushlists
+    barrier_wait(&g->barrier); //Wait for threads to finish their pushlists
     for(int i = 0; i < nThreads; i++) {
       for(int j = 0; j < g->pushes[i]->i; j++){
         push_t p = g->pushes[i]->a[j];
@@ -724,7 +705,7 @@ static int preflow(graph_t* g, int nThreads)
     }
     g->done = areWeDone(g);
     divideWork(g, nThreads);
-    pthread_barrier_wait(&g->barrier); // Let threads start making new pushlists
+    barrier_wait(&g->barrier); // Let threads start making new pushlists
   }
 
   pr("Program done!");
@@ -765,12 +746,16 @@ int main(int argc, char* argv[])
 	int		f;	/* output from preflow.		*/
 	int		n;	/* number of nodes.		*/
 	int		m;	/* number of edges.		*/
-  int   nThreads = 4;
+  int   nThreads = thread_count();
 
 	progname = argv[0];	/* name is a string in argv[0]. */
 
 	in = stdin;		/* same as System.in in Java.	*/
 
+#if MMAP_INPUT
+	open_input(&input, fileno(in));
+#endif
+
 	n = next_int();
 	m = next_int();
 
@@ -780,6 +765,10 @@ int main(int argc, char* argv[])
 
 	g = new_graph(in, n, m, nThreads);
 
+#if MMAP_INPUT
+	close_input(&input);
+#endif
+
 	fclose(in);
 
 	f = preflow(g, nThreads);
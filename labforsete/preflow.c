@@ -1,8 +1,11 @@
 /* This is an implementation of the preflow-push algorithm, by
  * Goldberg and Tarjan, for the 2021 EDAN26 Multicore programming labs.
  *
- * It is intended to be as simple as possible to understand and is
- * not optimized in any way.
+ * It was first written to be as simple as possible to understand and
+ * has since been optimized: the input is mapped and scanned without
+ * stdio, the solver memory comes from one arena, graphs can be built
+ * in batches through a builder, and besides the parallel push-relabel
+ * there are Dinic and Boykov-Kolmogorov engines.
  *
  * You should NOT read everything for this course.
  *
@@ -33,8 +36,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <pthread.h>
 
+#include "barrier.h"
+#include "input.h"
+#include "preflow.h"
+#include "threads.h"
+
 #define PRINT		0	/* enable/disable prints. */
 
 /* the funny do-while next clearly performs one iteration of the loop.
@@ -52,6 +64,13 @@
 #endif
 
 #define MIN(a,b)	(((a)<=(b))?(a):(b))
+#define MAX(a,b)	(((a)>=(b))?(a):(b))
+
+#define CACHE_LINE	64	/* bytes in a cache block. */
+#define EDGES		(1 << 16)	/* builder room when m is 0. */
+#define GROUPS		1024	/* first step of group_arcs. */
+#define GRAIN		16	/* fewest nodes in a chunk of work. */
+#define GRAIN_ARCS	256	/* or arcs with SCHEDULE_DEGREE. */
 
 /* introduce names for some structs. a struct is like a class, except
  * it cannot be extended and has no member methods, and everything is
@@ -62,44 +81,57 @@
  *
  */
 
-typedef struct graph_t	graph_t;
 typedef struct node_t	node_t;
 typedef struct edge_t	edge_t;
-typedef struct push_list_t	push_list_t;
 typedef struct node_list_t	node_list_t;
-typedef struct push_t	push_t;
 typedef struct work_arg_t	work_arg_t;
 typedef struct node_list_t node_list_t;
 typedef struct edge_list_t edge_list_t;
-typedef struct edge_data_t edge_data_t;
-typedef struct xedge_t	xedge_t;
+typedef struct arena_t	arena_t;
+
+enum {
+	SCHEDULE_STATIC,	/* see take_chunk.		*/
+	SCHEDULE_DYNAMIC,
+	SCHEDULE_DEGREE,
+};
 
-struct xedge_t {
-	int32_t		u;	/* one of the two nodes.	*/
-	int32_t		v;	/* the other. 			*/
-	int32_t		c;	/* capacity.			*/
+enum {
+	TREE_FREE,		/* see bk.			*/
+	TREE_S,
+	TREE_T,
 };
 
+#define PARENT_NONE	(-1)	/* orphan or free node.		*/
+#define PARENT_ROOT	(-2)	/* s or t in its own tree.	*/
+
 struct work_arg_t {
 	int			 index;
 	graph_t* g;
 	int			nThreads;
+	long		work;	/* pushes and relabels this round.	*/
+	long		load;	/* nodes and arcs looked at.	*/
+	long		weight;	/* degrees of nodes put in nextList.	*/
+	int		taken;	/* our slice with SCHEDULE_STATIC.	*/
 };
 
-struct edge_data_t {
-	int c;
-	int f;
+struct builder_t {
+	int		n;	/* nodes, at least max id + 1.	*/
+	int		m;	/* edges appended.		*/
+	int		cap;	/* room in deg.			*/
+	int*		deg;	/* degree of each node.		*/
+	size_t		room;	/* edges that fit in arcs.	*/
+	edge_t*		arcs;	/* see preflow_add_edges.	*/
 };
 
-struct push_list_t {
-	push_t* a;
-	int		 c;
-	int		 i;
+struct arena_t {
+	char*		base;	/* one allocation for all.	*/
+	size_t		size;	/* bytes in base.		*/
+	size_t		used;	/* bytes handed out.		*/
 };
 
 struct edge_list_t {
 	edge_t* a;
-	int		 c;
+	int		 c;	/* degree, i.e. room in a.	*/
 	int		 i;
 };
 
@@ -112,22 +144,15 @@ struct node_list_t {
 struct node_t {
 	int		h;	/* height.			*/
 	int		e;	/* excess flow.			*/
-	node_t*		next;	/* with excess preflow.		*/
+	node_t*		next;	/* with excess preflow, or to relabel.	*/
 	edge_list_t edge;
 	int	inExcess;
 };
 
 struct edge_t {
-	node_t*		v;	/* the other. 			*/
-	int		i;	/* edge index */
-	int		b;	//direction
-};
-
-struct push_t {
-	node_t* u; // Push from u
-	node_t* v; // Push to v
-	int		 edge_i;
-	int d; // Directed flow to push
+	int		v;	/* the other node.		*/
+	int		mate;	/* reverse arc is v's edge.a[mate].	*/
+	int		r;	/* residual capacity.		*/
 };
 
 struct graph_t {
@@ -137,12 +162,31 @@ struct graph_t {
 	node_t*		s;	/* source.			*/
 	node_t*		t;	/* sink.			*/
 	node_t*		excess;	/* nodes with e > 0 except s,t.	*/
-	edge_data_t* edge_data;
-	pthread_barrier_t barrier;
-	push_list_t** pushes;
-	node_list_t** relabels;
+	barrier_t	barrier;	/* between the rounds.		*/
 	node_list_t* workList;
+	node_list_t* nextList;		/* work list of the next round.		*/
+	arena_t		arena;		/* where all of the above is.		*/
+	edge_t*		arcs;		/* the 2m arcs, from the builder.	*/
+	int*		queue;		/* for global_relabel.			*/
+	int*		cur;		/* current arc for dinic.		*/
+	int*		stack;		/* path for dinic.			*/
+	char*		tree;		/* TREE_FREE, TREE_S or TREE_T for bk.	*/
+	int*		parent;		/* arc to the parent in the tree.	*/
+	int*		ts;		/* when the distance in h was found.	*/
+	long		work;		/* since the last global_relabel.	*/
+	int		phase;		/* 1 or 2, see xpreflow.		*/
+	int		phases;		/* 2 to make a flow of the preflow.	*/
+	double		alpha;		/* how often to global_relabel.		*/
+	int		nThreads;
 	int done;
+	int		schedule;	/* how to divide the work list.		*/
+	int		cursor;		/* next node to take in workList.	*/
+	long		weight;		/* degrees summed over workList.	*/
+	long		taken;		/* degrees of the nodes taken.		*/
+	int		stats;		/* print load imbalance statistics.	*/
+	int		rounds;		/* for the statistics in xpreflow.	*/
+	double		imbalance;	/* summed over the rounds.		*/
+	double		worst;		/* largest in a round.			*/
 };
 
 /* a remark about C arrays. the phrase above 'array of n nodes' is using
@@ -240,32 +284,6 @@ void error(const char* fmt, ...)
 	exit(1);
 }
 
-static int next_int()
-{
-	int		 x;
-	int		 c;
-
-	/* this is like Java's nextInt to get the next integer.
-	 *
-	 * we read the next integer one digit at a time which is
-	 * simpler and faster than using the normal function
-	 * fscanf that needs to do more work.
-	 *
-	 * we get the value of a digit character by subtracting '0'
-	 * so the character '4' gives '4' - '0' == 4
-	 *
-	 * it works like this: say the next input is 124
-	 * x is first 0, then 1, then 10 + 2, and then 120 + 4.
-	 *
-	 */
-
-	x = 0;
-	while (isdigit(c = getchar()))
-		x = 10 * x + c - '0';
-
-	return x;
-}
-
 static void* xmalloc(size_t s)
 {
 	void*		p;
@@ -315,176 +333,479 @@ static void* xcalloc(size_t n, size_t s)
 	return p;
 }
 
-static void add_edge(node_t* u, node_t* v, int i, int b)
+/* the solver needs the nodes, their arcs, and lists of nodes to work
+ * on, and all of them have a size we know from n and m before we
+ * start: a node has as many arcs as its degree, and in one round at
+ * most n nodes are in the work list.
+ *
+ * so instead of growing each list with realloc we take all of the
+ * memory with one xmalloc, hand it out with arena_alloc, and free it
+ * with one call to arena_free when the graph is freed. each piece
+ * starts at a cache block so that the lists of different threads do
+ * not share cache blocks.
+ *
+ */
+
+static size_t arena_round(size_t s)
+{
+	return (s + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static void arena_init(arena_t* a, size_t size)
+{
+	a->base = xmalloc(size + CACHE_LINE);
+	a->size = size + CACHE_LINE;
+	a->used = -(uintptr_t) a->base % CACHE_LINE;
+}
+
+static void* arena_alloc(arena_t* a, size_t n, size_t s)
+{
+	void*		p;
+
+	/* take n * s bytes, which are not zeroed, from the arena. */
+
+	if (a->used + arena_round(n * s) > a->size)
+		error("arena of %zu bytes is too small", a->size);
+
+	p = a->base + a->used;
+	a->used += arena_round(n * s);
+
+	return p;
+}
+
+static void arena_free(arena_t* a)
+{
+	free(a->base);
+	a->base = NULL;
+	a->size = a->used = 0;
+}
+
+static void add_work(graph_t* g, node_t* u) {
+	int i = g->workList->i;
+
+	/* a node is in the work list at most once per round so n
+	 * entries are enough.
+	 *
+	 */
+
+	assert(i < g->workList->c);
+
+	g->workList->a[i] = u;
+	g->workList->i+=1;
+	g->weight += u->edge.i + 1;
+}
+
+static int enter_next(graph_t* g, node_t* v)
+{
+	int		i;
+
+	/* put v in the work list of the next round. the workers do
+	 * this at the same time, so each takes an index with an
+	 * atomic add, and a node is put there only by the thread
+	 * which gave it excess when it had none or, if it still has
+	 * excess, the thread which worked on it. so it is there at
+	 * most once and n entries are enough. return whether it was
+	 * put there.
+	 *
+	 */
+
+	if (v == g->s || v == g->t)
+		return 0;
+
+	if (g->phase == 1 && v->h >= g->n)
+		return 0;	/* waits for phase 2, see xpreflow. */
+
+	i = __atomic_fetch_add(&g->nextList->i, 1, __ATOMIC_RELAXED);
+	assert(i < g->nextList->c);
+	g->nextList->a[i] = v;
+
+	return 1;
+}
+
+/* a graph is made in three steps with a builder:
+ *
+ *	b = preflow_builder(n, m);
+ *	preflow_add_edges(b, e, k);	as many times as needed
+ *	g = preflow_finalize(b, nThreads);
+ *
+ * n and m are only hints and may be too small (or 0). the builder writes
+ * the two arcs of each edge straight into the array that becomes the
+ * arcs of the graph, and counts the degrees as they are appended, so the
+ * caller needs no array with all edges. when the graph is finalized the
+ * arcs are moved to their nodes within the same array (see group_arcs
+ * and pair_arcs), so that there is only one copy of the edges at any
+ * time. if m was too small the array grows with realloc.
+ *
+ * then preflow_solve(g, s, t) finds the maximum flow from s to t,
+ * preflow_cut(g, side, &cut) gives a minimum cut, and preflow_free(g)
+ * frees everything. see also preflow.h.
+ *
+ */
+
+builder_t* preflow_builder(int n, int m)
 {
+	builder_t*	b;
 
-	/* allocate memory for a list link and put it first
-	 * in the adjacency list of u.
+	/* nodes from 0 to n - 1 are in the graph even if they have
+	 * no edges. with m there is room for all edges from the start.
 	 *
 	 */
 
-	if (u->edge.i == u->edge.c) {
-		edge_t* b;
-		u->edge.c *= 2; // double the capacity
-		//printf("add_edge realloc: newsize = %d\n", u->edge.c * sizeof(u->edge.a[0]));
-		b = realloc(u->edge.a, u->edge.c * sizeof(u->edge.a[0]));
-		if (b == NULL)
-			error("no memory");
-		u->edge.a = b;
+	b = xcalloc(1, sizeof(builder_t));
+	b->cap = n > 0 ? n : 16;
+	b->deg = xcalloc(b->cap, sizeof(int));
+	b->n = n > 0 ? n : 0;
+	b->room = m > 0 ? m : EDGES;
+	b->arcs = xmalloc(2 * b->room * sizeof(edge_t));
+
+	return b;
+}
+
+static void add_node(builder_t* b, int u)
+{
+	int		cap;
+
+	if (u < 0)
+		error("negative node %d", u);
+
+	if (u >= b->cap) {
+		cap = b->cap;
+		while (u >= cap)
+			cap *= 2;
+		b->deg = realloc(b->deg, cap * sizeof(int));
+		if (b->deg == NULL)
+			error("out of memory: realloc(%zu) failed", cap * sizeof(int));
+		memset(b->deg + b->cap, 0, (cap - b->cap) * sizeof(int));
+		b->cap = cap;
 	}
 
-	u->edge.a[u->edge.i].v = v;
-	u->edge.a[u->edge.i].i = i;
-	u->edge.a[u->edge.i].b = b;
-	u->edge.i += 1;
+	if (u >= b->n)
+		b->n = u + 1;
+
+	b->deg[u] += 1;
 }
 
-static void add_push(graph_t* g, node_t* u, node_t* v, int edge_index, int d, int threadIndex)
+void preflow_add_edges(builder_t* b, const xedge_t* e, int k)
 {
-	if (g->pushes[threadIndex]->i == g->pushes[threadIndex]->c) {
-		push_t* b;
-		g->pushes[threadIndex]->c *= 2; // double the capacity
-		//printf("add_push realloc: newsize = %d\n", g->pushes[threadIndex]->c * sizeof(g->pushes[threadIndex]->a[0]));
-		b = realloc(g->pushes[threadIndex]->a, g->pushes[threadIndex]->c * sizeof(g->pushes[threadIndex]->a[0]));
-		if (b == NULL)
-			error("no memory");
-		g->pushes[threadIndex]->a = b;
+	edge_t*		a;
+	int		i;
+
+	/* edge i is arcs[2 * i] from u and arcs[2 * i + 1] from v.
+	 * until preflow_finalize, mate is the node the arc is from.
+	 *
+	 */
+
+	for (i = 0; i < k; i += 1) {
+		if ((size_t) b->m == b->room) {
+			b->room *= 2;
+			b->arcs = realloc(b->arcs, 2 * b->room * sizeof(edge_t));
+			if (b->arcs == NULL)
+				error("out of memory: realloc(%zu) failed", 2 * b->room * sizeof(edge_t));
+		}
+
+		if (e[i].c < 0)
+			error("negative capacity %d", e[i].c);
+
+		add_node(b, e[i].u);
+		add_node(b, e[i].v);
+
+		a = &b->arcs[2 * (size_t) b->m];
+		a[0].v = e[i].v;
+		a[0].mate = e[i].u;
+		a[0].r = e[i].c;
+		a[1].v = e[i].u;
+		a[1].mate = e[i].v;
+		a[1].r = e[i].c;
+		b->m += 1;
 	}
+}
+
+static void move_arcs(edge_t** next, edge_t** end, int k, int shift)
+{
+	edge_t		x;
+	int		i;
+	int		w;
+
+	/* put each arc in next[i] to end[i] - 1, where i is the node
+	 * the arc is from, which is in mate, shifted right by shift.
+	 * next[i] is the first place of i which does not have an arc
+	 * of i yet. an arc of some other i is swapped with next[i],
+	 * and we look again at what came back. each swap puts one arc
+	 * in place so this is linear in the arcs.
+	 *
+	 */
 
-	pr("add_push changing excess node:%d, e=%d, d=%d\n", id(g,u), u->e, d);
-	u->e -= d;
+	for (i = 0; i < k; i += 1) {
+		while (next[i] < end[i]) {
+			x = *next[i];
+			w = x.mate >> shift;
 
-	int i = g->pushes[threadIndex]->i++;
-	g->pushes[threadIndex]->a[i].u = u;
-	g->pushes[threadIndex]->a[i].v = v;
-	g->pushes[threadIndex]->a[i].edge_i = edge_index;
-	g->pushes[threadIndex]->a[i].d = d;
+			if (w == i) {
+				next[i] += 1;
+				continue;
+			}
+
+			*next[i] = *next[w];
+			*next[w]++ = x;
+		}
+	}
 }
 
-static void add_relabel(graph_t* g, node_t* u, int threadIndex) {
-	if (g->relabels[threadIndex]->i == g->relabels[threadIndex]->c) {
-		node_t** b;
-		g->relabels[threadIndex]->c *= 2; // double the capacity
-		//printf("add_relabel realloc: newsize = %d\n", g->relabels[threadIndex]->c * sizeof(g->relabels[threadIndex]->a[0]));
-		b = realloc(g->relabels[threadIndex]->a, g->relabels[threadIndex]->c * sizeof(g->relabels[threadIndex]->a[0]));
-		if (b == NULL)
-			error("no memory");
-		g->relabels[threadIndex]->a = b;
+static void group_arcs(graph_t* g)
+{
+	edge_t**	next;
+	edge_t**	end;
+	int		shift;
+	int		k;
+	int		i;
+
+	/* move every arc to the part of the array of the node it is
+	 * from, in place. each swap of move_arcs goes to a random
+	 * node and waits for the one before, which is slow when the
+	 * arcs do not fit in the cache. so we first move the arcs to
+	 * groups of 1 << shift nodes, at most GROUPS of them, whose
+	 * next places stay in the cache, and then to their nodes, which
+	 * now are near each other.
+	 *
+	 */
+
+	for (shift = 0; (g->n - 1) >> shift >= GROUPS; shift += 1)
+		;
+
+	k = ((g->n - 1) >> shift) + 1;
+	next = xmalloc(g->n * sizeof(edge_t*));
+	end = xmalloc(g->n * sizeof(edge_t*));
+
+	for (i = 0; i < k; i += 1) {
+		next[i] = g->v[i << shift].edge.a;
+		end[i] = i + 1 < k ? g->v[(i + 1) << shift].edge.a : g->arcs + 2 * (size_t) g->m;
+	}
+
+	move_arcs(next, end, k, shift);
+
+	for (i = 0; i < g->n; i += 1) {
+		next[i] = g->v[i].edge.a;
+		end[i] = next[i] + g->v[i].edge.c;
 	}
 
-	g->relabels[threadIndex]->a[g->relabels[threadIndex]->i] = u;
-	g->relabels[threadIndex]->i += 1;
+	if (shift > 0)
+		move_arcs(next, end, g->n, 0);
+
+	free(next);
+	free(end);
 }
 
-static void add_work(graph_t* g, node_t* u) {
-	if (g->workList->i == g->workList->c) {
-		node_t** b;
-		g->workList->c *= 2; // double the capacity
-		//printf("add_work realloc: newsize = %d\n", g->workList->c * sizeof(g->workList->a[0]));
-		b = realloc(g->workList->a, g->workList->c * sizeof(g->workList->a[0]));
-		if (b == NULL)
-			error("no memory");
-		for(int i = g->workList->i; i < g->workList->c; i++){
-			b[i] = NULL;
-		}
-		g->workList->a = b;
+static int arc_before(const void* ap, const void* bp)
+{
+	const edge_t*	a = ap;
+	const edge_t*	b = bp;
+
+	if (a->v != b->v)
+		return (a->v > b->v) - (a->v < b->v);
+
+	return (a->r > b->r) - (a->r < b->r);
+}
+
+static void sort_arcs(edge_t* a, int n)
+{
+	edge_t		x;
+	int		i;
+	int		j;
+
+	/* the arcs of a node by the other node and then capacity.
+	 * most nodes have few arcs, so insertion sort is best unless
+	 * there are many.
+	 *
+	 */
+
+	if (n > 64) {
+		qsort(a, n, sizeof(edge_t), arc_before);
+		return;
 	}
 
-	g->workList->a[g->workList->i] = u;
-	g->workList->i+=1;
+	for (i = 1; i < n; i += 1) {
+		x = a[i];
+		for (j = i; j > 0 && (a[j-1].v > x.v
+			|| (a[j-1].v == x.v && a[j-1].r > x.r)); j -= 1)
+			a[j] = a[j-1];
+		a[j] = x;
+	}
 }
 
-static void connect(node_t* u, node_t* v, int i)
+static void pair_arcs(graph_t* g)
 {
-	/* connect two nodes by putting a shared (same object)
-	 * in their adjacency lists.
+	node_t*		u;
+	edge_t*		a;
+	edge_t*		b;
+	int*		next;
+	int		i;
+	int		j;
+
+	/* group_arcs does not keep the two arcs of an edge together
+	 * so we find the mate of each arc again. with the arcs of each
+	 * node sorted, the arcs from u to w with capacity c are in the
+	 * same order as the arcs from w to u with capacity c, and any
+	 * pairing of those is right since they are all alike until
+	 * the solve.
+	 *
+	 * we pair the arcs of u to the higher nodes w. next[w] is the
+	 * first arc of w which is not paired yet with an arc from a
+	 * lower node, and it goes to u since the lower nodes are done.
+	 * an edge from u to itself is two arcs next to each other.
 	 *
 	 */
 
-	add_edge(u, v, i, 1);
-	add_edge(v, u, i, -1);
+	next = g->cur;
+	memset(next, 0, g->n * sizeof(int));
+
+	for (i = 0; i < g->n; i += 1)
+		sort_arcs(g->v[i].edge.a, g->v[i].edge.c);
+
+	for (i = 0; i < g->n; i += 1) {
+		u = &g->v[i];
+
+		for (j = 0; j < u->edge.c; j += 1) {
+			a = &u->edge.a[j];
+
+			if (a->v < i)
+				continue;
+
+			if (a->v == i) {
+				a[0].mate = j + 1;
+				a[1].mate = j;
+				j += 1;
+				continue;
+			}
+
+			b = &g->v[a->v].edge.a[next[a->v]];
+			assert(b->v == i && b->r == a->r);
+			a->mate = next[a->v];
+			b->mate = j;
+			next[a->v] += 1;
+		}
+	}
 }
 
-#ifdef MAIN
-static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
-#else
-static graph_t* new_graph(int n, int m, int s, int t, xedge_t* e, int nThreads)
-#endif
+graph_t* preflow_finalize(builder_t* b, int nThreads)
 {
 	graph_t*	g;
-	node_t*		u;
-	node_t*		v;
+	edge_t*		arcs;
+	size_t		size;
+	size_t		k;
+	int		n;
+	int		m;
 	int		i;
-	int		a;
-	int		b;
-	int		c;
 
 	g = xmalloc(sizeof(graph_t));
 
+	n = b->n;
+	m = b->m;
+
+	if (n < 2)
+		error("a graph needs at least two nodes");
+
 	g->n = n;
 	g->m = m;
+	g->nThreads = nThreads;
 	g->done = 0;
 
-	g->v = xcalloc(n, sizeof(node_t));
-	g->edge_data = xcalloc(m, sizeof(edge_data_t));
+	size = arena_round(n * sizeof(node_t))
+		+ 2 * arena_round(n * sizeof(node_t*))
+		+ 5 * arena_round(n * sizeof(int))
+		+ arena_round(n * sizeof(char))
+		+ 2 * arena_round(sizeof(node_list_t));
+
+	arena_init(&g->arena, size);
+
+	g->v = arena_alloc(&g->arena, n, sizeof(node_t));
+	g->queue = arena_alloc(&g->arena, n, sizeof(int));
+	g->cur = arena_alloc(&g->arena, n, sizeof(int));
+	g->stack = arena_alloc(&g->arena, n, sizeof(int));
+	g->tree = arena_alloc(&g->arena, n, sizeof(char));
+	g->parent = arena_alloc(&g->arena, n, sizeof(int));
+	g->ts = arena_alloc(&g->arena, n, sizeof(int));
+	g->work = 0;
+	g->alpha = 6;
+	g->phases = 1;
+	g->schedule = SCHEDULE_DYNAMIC;
+	g->cursor = 0;
+	g->weight = 0;
+	g->taken = 0;
+	g->stats = 0;
+	g->rounds = 0;
+	g->imbalance = 0;
+	g->worst = 0;
+
+	memset(g->v, 0, n * sizeof(node_t));
 
 	g->s = &g->v[0];
 	g->t = &g->v[n-1];
 	g->excess = NULL;
 
-	for (i = 0; i < n; i += 1) {
-		g->v[i].edge.c = 2;
-		g->v[i].edge.i = 0;
-		g->v[i].edge.a = malloc(g->v[i].edge.c * sizeof(edge_t));
-	}
+	/* give back the room for edges that never came. */
 
-	for (i = 0; i < m; i += 1) {
-#ifdef MAIN
-		a = next_int();
-		b = next_int();
-		c = next_int();
-#else
-		a = e[i].u;
-		b = e[i].v;
-		c = e[i].c;
-#endif
-		u = &g->v[a];
-		v = &g->v[b];
-		g->edge_data[i].c = c;
-		g->edge_data[i].f = 0;
-		connect(u, v, i);
-	}
+	g->arcs = b->arcs;
 
-	g->pushes = xcalloc(nThreads, sizeof(push_list_t*));
-	for (int i = 0; i < nThreads; i++){
-		g->pushes[i] = xmalloc(sizeof(push_list_t));
-		g->pushes[i]->c = 8;
-		g->pushes[i]->a = malloc(g->pushes[i]->c * sizeof(push_t));
-		if(g->pushes[i]->a == NULL) error("no memory");
-		g->pushes[i]->i = 0;
+	if (m > 0 && b->room > (size_t) m) {
+		arcs = realloc(g->arcs, 2 * (size_t) m * sizeof(edge_t));
+		if (arcs != NULL)
+			g->arcs = arcs;
 	}
 
-	g->relabels = xcalloc(nThreads, sizeof(node_list_t*));
-	for (int i = 0; i < nThreads; i++){
-		g->relabels[i] = xmalloc(sizeof(node_list_t));
-		g->relabels[i]->c = 8;
-		g->relabels[i]->a = malloc(g->relabels[i]->c * sizeof(push_t));
-		if(g->relabels[i]->a == NULL) error("no memory");
-		g->relabels[i]->i = 0;
+	for (i = 0, k = 0; i < n; i += 1) {
+		g->v[i].edge.a = &g->arcs[k];
+		g->v[i].edge.c = b->deg[i];
+		g->v[i].edge.i = b->deg[i];
+		k += b->deg[i];
 	}
 
-	g->workList = xmalloc(sizeof(node_list_t));
-	g->workList->c = 8;
-	g->workList->a = malloc(c * sizeof(push_t));
-	if(g->workList->a == NULL) error("no memory");
+	free(b->deg);
+	free(b);
+
+	group_arcs(g);
+	pair_arcs(g);
+
+	g->workList = arena_alloc(&g->arena, 1, sizeof(node_list_t));
+	g->workList->c = n;
+	g->workList->a = arena_alloc(&g->arena, n, sizeof(node_t*));
 	g->workList->i = 0;
 
-	if(pthread_barrier_init(&g->barrier, NULL, nThreads + 1) != 0) //nThreads+1 because of main thread
-		error("g pthread_barrier_init failed");
+	g->nextList = arena_alloc(&g->arena, 1, sizeof(node_list_t));
+	g->nextList->c = n;
+	g->nextList->a = arena_alloc(&g->arena, n, sizeof(node_t*));
+	g->nextList->i = 0;
+
+	if(barrier_init(&g->barrier, nThreads + 1) != 0) //nThreads+1 because of main thread
+		error("g barrier_init failed, is PREFLOW_BARRIER pthread, spin or futex?");
 
 	return g;
 }
 
+#ifdef MAIN
+static graph_t* new_graph(FILE* in, int n, int m, int nThreads)
+{
+	builder_t*	b;
+	xedge_t		e[1024];
+	int		i;
+	int		k;
+
+	/* read the edges in batches into a builder. */
+
+	b = preflow_builder(n, m);
+
+	for (i = 0; i < m; i += k) {
+		for (k = 0; k < 1024 && i + k < m; k += 1) {
+			e[k].u = next_int();
+			e[k].v = next_int();
+			e[k].c = next_int();
+		}
+		preflow_add_edges(b, e, k);
+	}
+
+	return preflow_finalize(b, nThreads);
+}
+#endif
+
 static void enter_excess(graph_t* g, node_t* v)
 {
 	/* put v at the front of the list of nodes
@@ -523,15 +844,13 @@ static node_t* leave_excess(graph_t* g)
 	return v;
 }
 
-static void push(graph_t* g, node_t* u, node_t* v, int edge_i, int d)
+static void push(graph_t* g, node_t* u, node_t* v, int d)
 {
 
 	pr("push from %d to %d: ", id(g, u), id(g, v));
-	pr("f = %d, c = %d, so ", g->edge_data[edge_i].f, g->edge_data[edge_i].c);
 
 	pr("pushing %d\n", d);
 
-	//u->e -= d; //Move this to add_push
 	pr("push changing excess node:%d, e=%d, d=%d\n", id(g,v), v->e, d);
 	v->e += d;
 
@@ -539,7 +858,6 @@ static void push(graph_t* g, node_t* u, node_t* v, int edge_i, int d)
 
 	assert(d > 0);
 	assert(u->e >= 0 || u == g->s);
-	assert(abs(g->edge_data[edge_i].f) <= g->edge_data[edge_i].c);
 
 	if (u->e > 0) {
 
@@ -558,96 +876,287 @@ static void push(graph_t* g, node_t* u, node_t* v, int edge_i, int d)
 	}
 }
 
-static void relabel(graph_t* g, node_t* u)
+static int relabel(graph_t* g, node_t* u)
 {
 	u->h += 1;
 	pr("relabel %d now h = %d\n", id(g, u), u->h);
-	enter_excess(g, u);
+	return enter_next(g, u);
 }
 
-static int check_done(graph_t* g) {
-	pr("s->e=%d\n", g->s->e);
-	pr("t->e=%d\n", g->t->e);
-	return -g->s->e == g->t->e;
+static int search(graph_t* g, int i, int k, int unseen)
+{
+	node_t*		u;
+	node_t*		w;
+	edge_t*		a;
+	int		j;
+
+	/* continue the breadth first search with the nodes in
+	 * queue[i] to queue[k - 1], through arcs to them with
+	 * residual capacity, and give the nodes found the height
+	 * of the node they were found from plus one. return how
+	 * many nodes are in the queue now.
+	 *
+	 */
+
+	while (i < k) {
+		u = &g->v[g->queue[i++]];
+
+		for (j = 0; j < u->edge.i; j += 1) {
+			a = &u->edge.a[j];
+			w = &g->v[a->v];
+			if (w->h == unseen && w->edge.a[a->mate].r > 0) {
+				w->h = u->h + 1;
+				g->queue[k++] = a->v;
+			}
+		}
+	}
+
+	return k;
+}
+
+static void global_relabel(graph_t* g)
+{
+	int		unseen;
+	int		i;
+	int		k;
+
+	/* give every node its distance to t through arcs with
+	 * residual capacity, or n plus its distance to s if it cannot
+	 * reach t, and 2n - 1 if it can reach neither and so never
+	 * will have excess. a relabel only adds one to a height so
+	 * without this nodes often climb one step at a time.
+	 *
+	 * the main thread does this between the two barriers, when
+	 * no worker looks at the heights.
+	 *
+	 */
+
+	unseen = 2 * g->n - 1;
+
+	for (i = 0; i < g->n; i += 1)
+		g->v[i].h = unseen;
+
+	g->t->h = 0;
+	g->queue[0] = g->t - g->v;
+	g->s->h = g->n;
+	k = search(g, 0, 1, unseen);
+
+	g->queue[k] = g->s - g->v;
+	search(g, k, k + 1, unseen);
+
+	g->work = 0;
+}
+
+static int take_chunk(graph_t* g, work_arg_t* args, int* start, int* end)
+{
+	node_list_t*	list;
+	long		target;
+	long		w;
+	int		n;
+	int		i;
+	int		j;
+
+	/* give the thread of args the next part of the work list,
+	 * start to end - 1, or return 0 when there is nothing left.
+	 *
+	 *	SCHEDULE_STATIC		each thread takes one slice of
+	 *				the same length. a thread with a
+	 *				few nodes of high degree then
+	 *				holds up everyone at the barrier.
+	 *
+	 *	SCHEDULE_DYNAMIC	the threads take chunks from a
+	 *				shared cursor as they finish the
+	 *				previous one. a chunk is what is
+	 *				left divided by 2 * nThreads, but
+	 *				at least GRAIN nodes, so chunks
+	 *				are large at first and small at
+	 *				the end of the round.
+	 *
+	 *	SCHEDULE_DEGREE		as SCHEDULE_DYNAMIC but what is
+	 *				left and the size of a chunk are
+	 *				measured in arcs, since that is
+	 *				what it takes to look at a node.
+	 *
+	 * the cursor is moved with compare and swap since the end of
+	 * the chunk depends on where it starts.
+	 *
+	 */
+
+	list = g->workList;
+	n = list->i;
+
+	if (g->schedule == SCHEDULE_STATIC) {
+		if (args->taken)
+			return 0;
+		args->taken = 1;
+		j = (n + (args->nThreads - 1)) / args->nThreads + 1;
+		*start = MIN(j * args->index, n);
+		*end = MIN(j * (args->index + 1), n);
+		return *start < *end;
+	}
+
+	i = __atomic_load_n(&g->cursor, __ATOMIC_RELAXED);
+	w = 0;
+
+	do {
+		if (i >= n)
+			return 0;
+
+		if (g->schedule == SCHEDULE_DYNAMIC)
+			j = MIN(i + MAX((n - i) / (2 * args->nThreads), GRAIN), n);
+		else {
+			target = g->weight - __atomic_load_n(&g->taken, __ATOMIC_RELAXED);
+			target = MAX(target / (2 * args->nThreads), GRAIN_ARCS);
+			for (j = i, w = 0; j < n && w < target; j += 1)
+				w += list->a[j]->edge.i + 1;
+		}
+	} while (!__atomic_compare_exchange_n(&g->cursor, &i, j, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (g->schedule == SCHEDULE_DEGREE)
+		__atomic_fetch_add(&g->taken, w, __ATOMIC_RELAXED);
+
+	*start = i;
+	*end = j;
+
+	return 1;
 }
 
 static void* work(void* argsIn) {
 	work_arg_t* args = (work_arg_t*) argsIn;
 	graph_t* g			 = args->g;
-	int index				= args->index;
-	int nThreads		 = args->nThreads;
 	node_t*		u;
-	edge_t*		e;
-	int				b;
+	node_t*		v;
+	node_t*		list;
+	edge_t*		a;
 	int				d;
-	int				hasPushed = 0;
+	int				e;
+	int				j;
+	int				pushes;
+	int				start;
+	int				end;
 
 	int				nodesProcessed = 0;
 	while(!g->done){
-		int numberOfWorks = (g->workList->i + (nThreads - 1))/nThreads + 1;
-		int start = numberOfWorks*index;
-		int end = numberOfWorks*(index+1);
-		for(int i = start; i < end && i < g->workList->i; i++) {
-			u = g->workList->a[i];
-
-			/* u is any node with excess preflow. */
-
-			pr("Thread %d takes node %d from excess list\n", index, id(g, u));
-			pr("with h = %d and e = %d\n", u->h, u->e);
-			assert(u->e > 0);
-
-			/* if we can push we must push and only if we could
-			 * not push anything, we are allowed to relabel.
-			 *
-			 * we can push to multiple nodes if we wish but
-			 * here we just push once for simplicity.
-			 *
-			 */
-
-			hasPushed = 0;
-
-			for(int i = 0; i < u->edge.i && u->e > 0; i++) {
-				pr("Node %d checking edge %d\n", id(g,u), i);
-				if (u->h > u->edge.a[i].v->h) {
-					int edge_i = u->edge.a[i].i;
-					edge_data_t* e = &g->edge_data[edge_i];
-					if (u->edge.a[i].b == 1) {
-						d = MIN(u->e, e->c - e->f);
-					} else {
-						d = MIN(u->e, e->c + e->f);
-					}
-					pr("u->h > u->edge.a[i].v->h = %d\n", u->h > u->edge.a[i].v->h);
-					pr("u->edge.a[i].b * e->f < e->c = %d\n", u->edge.a[i].b * e->f < e->c);
-					pr("u->edge.a[i].b = %d\ne.f = %d\ne.c = %d\n", u->edge.a[i].b, e->f, e->c);
-					if (u->edge.a[i].b * e->f < e->c) {
-						hasPushed = 1;
-						pr("Thread %d creates push, %d->%d\n", index, id(g,u), id(g,u->edge.a[i].v));
-						add_push(g, u, u->edge.a[i].v, edge_i, d, index);
-						pr("Changing e->f by %d", u->edge.a[i].b * d);
-						g->edge_data[edge_i].f += u->edge.a[i].b * d;
+		args->taken = 0;
+		list = NULL;	/* to relabel, linked through next. */
+
+		while (take_chunk(g, args, &start, &end)) {
+			for(int i = start; i < end; i++) {
+				u = g->workList->a[i];
+
+				/* a global_relabel can have lifted u to n or above. */
+
+				if (g->phase == 1 && u->h >= g->n)
+					continue;
+
+				/* u is any node with excess preflow. the heights do
+				 * not change until the next barrier so we can push
+				 * right away, and the workers of other nodes can at
+				 * the same time push to u, so the excess is changed
+				 * with atomic adds. when it becomes zero u is no
+				 * longer ours: whoever pushes to it next puts it in
+				 * the next work list.
+				 *
+				 */
+
+				pr("Thread %d takes node %d from excess list\n", args->index, id(g, u));
+				e = __atomic_load_n(&u->e, __ATOMIC_ACQUIRE);
+				assert(e > 0);
+				pushes = 0;
+
+				for(j = 0; j < u->edge.i; j++) {
+					pr("Node %d checking edge %d\n", id(g,u), j);
+					a = &u->edge.a[j];
+					v = &g->v[a->v];
+					if (u->h > v->h && a->r > 0) {
+						d = MIN(e, a->r);
+						a->r -= d;
+						v->edge.a[a->mate].r += d;
+						pushes += 1;
+						pr("Thread %d pushes %d, %d->%d\n", args->index, d, id(g,u), id(g,v));
+
+						if (__atomic_fetch_add(&v->e, d, __ATOMIC_ACQ_REL) == 0
+							&& enter_next(g, v))
+							args->weight += v->edge.i + 1;
+
+						e = __atomic_sub_fetch(&u->e, d, __ATOMIC_ACQ_REL);
+						if (e == 0)
+							break;
 					}
 				}
-			}
-			nodesProcessed++;
-
-			if(!hasPushed) {
-				pr("Adding node %d to relabel list\n", id(g,u));
-				add_relabel(g, u, index);
+				nodesProcessed++;
+				args->work += pushes;
+				args->load += j + 1;
+
+				if (e == 0)
+					continue;
+				else if (pushes > 0) {
+					if (enter_next(g, u))
+						args->weight += u->edge.i + 1;
+				} else {
+					pr("Adding node %d to relabel list\n", id(g,u));
+					u->next = list;
+					list = u;
+				}
 			}
 		}
 		pr("Thread %d waiting at barrier 1\n", index);
-		pthread_barrier_wait(&g->barrier); //Tell main thread our pushList is ready
+		barrier_wait(&g->barrier); //Tell the others our pushes are done
+
+		/* now nobody looks at the heights so we relabel our nodes. */
+
+		for (u = list; u != NULL; u = u->next) {
+			if (relabel(g, u))
+				args->weight += u->edge.i + 1;
+			args->work += u->edge.i + 12;
+		}
+
 		pr("Thread %d waiting at barrier 2\n", index);
-		pthread_barrier_wait(&g->barrier); //Wait for main thread to finish processing
+		barrier_wait(&g->barrier); //Tell main thread the next work list is ready
+		pr("Thread %d waiting at barrier 3\n", index);
+		barrier_wait(&g->barrier); //Wait for main thread to start the next round
 	}
 	//printf("Thread exited, %d nodes processed\n", nodesProcessed);
+	return NULL;
+}
+
+static void balance(graph_t* g, work_arg_t* args, int nThreads)
+{
+	double		ratio;
+	long		max;
+	long		sum;
+	int		i;
+
+	/* the load of a round is what the busiest thread did compared
+	 * with the mean, i.e. 1 when all did the same and nThreads when
+	 * one did everything while the others waited at the barrier.
+	 *
+	 */
+
+	for (i = max = sum = 0; i < nThreads; i += 1) {
+		max = MAX(max, args[i].load);
+		sum += args[i].load;
+		args[i].load = 0;
+	}
+
+	if (sum == 0)
+		return;
+
+	ratio = (double) max * nThreads / sum;
+	g->rounds += 1;
+	g->imbalance += ratio;
+	g->worst = MAX(g->worst, ratio);
 }
 
 static void divideWork(graph_t* g, int nThreads) {
 	node_t* u;
 	g->workList->i = 0;
+	g->weight = 0;
 	while ((u = leave_excess(g)) != NULL) {
 		assert(u->e > 0);
+		if (g->phase == 1 && u->h >= g->n)
+			continue;	/* waits for phase 2, see xpreflow. */
 		pr("Add node %d to workList with e=%d\n", id(g,u), u->e);
 		add_work(g, u);
 	}
@@ -656,14 +1165,31 @@ static void divideWork(graph_t* g, int nThreads) {
 static int xpreflow(graph_t* g, int nThreads)
 {
 	node_t*		s;
-	node_t*		u;
 	node_t*		v;
-	edge_t*		e;
-	int		b;
+	edge_t*		a;
+	long		limit;
 
 	s = g->s;
 	s->h = g->n;
 
+	/* a global_relabel is done when the pushes and relabels since
+	 * the last one are more than alpha * n + m, where a relabel of
+	 * u counts as the arcs of u. zero alpha means never.
+	 *
+	 */
+
+	limit = g->alpha * g->n + g->m;
+
+	/* phase 1 stops when every node with excess is at n or above,
+	 * i.e. cannot reach t. then the excess of t is the maximum flow.
+	 * phase 2, if g->phases is 2, pushes their excess back to s so
+	 * that we end with a flow. in phase 1 divideWork leaves nodes at
+	 * n or above out of the work list, and phase 2 puts them back.
+	 *
+	 */
+
+	g->phase = 1;
+
 	/* start by pushing as much as possible (limited by
 	 * the edge capacity) from the source to its neighbors.
 	 *
@@ -672,19 +1198,20 @@ static int xpreflow(graph_t* g, int nThreads)
 	//initial pushes
 	int d;
 	for(int i = 0; i < s->edge.i; i++) {
-		int edge_i = s->edge.a[i].i;
-		edge_data_t e = g->edge_data[edge_i];
-		s->e -= e.c;
-		if (s->edge.a[i].b == 1) {
-			d = e.c;
-			e.f += d;
-		} else {
-			d = e.c;
-			e.f -= d;
-		}
-		push(g, s, s->edge.a[i].v, edge_i, d);
+		a = &s->edge.a[i];
+		v = &g->v[a->v];
+		d = a->r;
+		if (d == 0)
+			continue;
+		s->e -= d;
+		a->r = 0;
+		v->edge.a[a->mate].r += d;
+		push(g, s, v, d);
 	}
 
+	if (g->alpha > 0)
+		global_relabel(g);
+
 	divideWork(g, nThreads);
 
 	work_arg_t* args = xcalloc(nThreads, sizeof(work_arg_t));
@@ -695,32 +1222,52 @@ static int xpreflow(graph_t* g, int nThreads)
 		args[i].index = i;
 		args[i].g = g;
 		args[i].nThreads = nThreads;
-		if (pthread_create(&thread[i], NULL, work, (void*) &args[i]) != 0)
-			error("pthread_create failed");
+		start_thread(&thread[i], i, work, &args[i]);
 	}
 
+	/* the workers push and relabel their nodes and build the
+	 * next work list themselves (see work), so the main thread
+	 * only swaps the lists and does what needs everyone to wait.
+	 *
+	 */
+
 	while(!g->done) {
-		pthread_barrier_wait(&g->barrier); //Wait for threads to finish their pushlists
+		barrier_wait(&g->barrier); //Wait for threads to push
+		barrier_wait(&g->barrier); //and to relabel
+		node_list_t* list = g->workList;
+		g->workList = g->nextList;
+		g->nextList = list;
+		g->nextList->i = 0;
+		g->cursor = 0;
+		g->weight = 0;
+		g->taken = 0;
 		for(int i = 0; i < nThreads; i++) {
-			for(int j = 0; j < g->pushes[i]->i; j++){
-				push_t p = g->pushes[i]->a[j];
-				push(g, p.u, p.v, p.edge_i, p.d);
-			}
-			g->pushes[i]->i = 0;
+			g->work += args[i].work;
+			g->weight += args[i].weight;
+			args[i].work = 0;
+			args[i].weight = 0;
 		}
-		for(int i = 0; i < nThreads; i++) {
-			for(int j = 0; j < g->relabels[i]->i; j++){
-				relabel(g, g->relabels[i]->a[j]);
-			}
-			g->relabels[i]->i = 0;
+		balance(g, args, nThreads);
+		if (g->alpha > 0 && g->work > limit)
+			global_relabel(g);
+		if (g->workList->i == 0 && g->phase == 1 && g->phases == 2) {
+			g->phase = 2;
+			for (int i = 0; i < g->n; i++)
+				if (g->v[i].e > 0)
+					enter_excess(g, &g->v[i]);
+			divideWork(g, nThreads);
 		}
-		g->done = check_done(g);
-		divideWork(g, nThreads);
-		pthread_barrier_wait(&g->barrier); // Let threads start making new pushlists
+		g->done = g->workList->i == 0;
+		barrier_wait(&g->barrier); // Let threads start the next round
 	}
 
 	pr("Program done!");
 
+	if (g->stats)
+		fprintf(stderr, "%s: %d rounds, load imbalance %.2f mean %.2f worst\n",
+			progname, g->rounds, g->rounds > 0 ? g->imbalance / g->rounds : 1.0,
+			MAX(g->worst, 1.0));
+
 	// Wait for threads to finish
 	for (int i = 0; i < nThreads; i++){
 		pthread_join(thread[i], NULL);
@@ -729,47 +1276,623 @@ static int xpreflow(graph_t* g, int nThreads)
 	return g->t->e;
 }
 
-static void free_graph(graph_t* g, int n, int nThreads)
+void preflow_free(graph_t* g)
 {
+	barrier_destroy(&g->barrier);
+	arena_free(&g->arena);
+	free(g->arcs);
+	free(g);
+}
+
+static int levels(graph_t* g)
+{
+	node_t*		u;
+	node_t*		w;
+	edge_t*		a;
 	int		i;
+	int		j;
+	int		k;
 
-	for (int i = 0; i < nThreads; i++){
-		free(g->pushes[i]->a);
-		free(g->pushes[i]);
+	/* give each node its distance from s through arcs with
+	 * residual capacity as h, or -1 if it cannot be reached, and
+	 * return whether t can be reached.
+	 *
+	 */
+
+	for (i = 0; i < g->n; i += 1) {
+		g->v[i].h = -1;
+		g->cur[i] = 0;
 	}
-	free(g->pushes);
 
-	for (int i = 0; i < nThreads; i++){
-		free(g->relabels[i]->a);
-		free(g->relabels[i]);
+	g->s->h = 0;
+	g->queue[0] = g->s - g->v;
+	k = 1;
+
+	for (i = 0; i < k && g->t->h < 0; i += 1) {
+		u = &g->v[g->queue[i]];
+		for (j = 0; j < u->edge.i; j += 1) {
+			a = &u->edge.a[j];
+			w = &g->v[a->v];
+			if (w->h < 0 && a->r > 0) {
+				w->h = u->h + 1;
+				g->queue[k++] = a->v;
+			}
+		}
 	}
-	free(g->relabels);
 
-	free(g->workList->a);
-	free(g->workList);
-	for (i = 0; i < n; i += 1) {
-		free(g->v[i].edge.a);
+	return g->t->h >= 0;
+}
+
+static int blocking_flow(graph_t* g)
+{
+	node_t*		u;
+	edge_t*		a;
+	int		flow;
+	int		top;
+	int		d;
+	int		i;
+
+	/* find paths from s to t along which the level goes up by one
+	 * at each arc, with a depth first search that is a loop and
+	 * not recursive so that long paths need no deep call stack.
+	 *
+	 * stack[0..top] are the nodes of the path so far and the arc
+	 * from stack[i] is its current arc, cur[stack[i]]. an arc that
+	 * cannot be used in this level graph is never looked at again
+	 * since the current arc only moves forward, and a node from
+	 * which t cannot be reached is given level -1.
+	 *
+	 * when t is reached we push the smallest residual capacity of
+	 * the path and continue from the tail of the first arc that
+	 * became saturated.
+	 *
+	 */
+
+	flow = 0;
+	top = 0;
+	g->stack[0] = g->s - g->v;
+
+	while (top >= 0) {
+		u = &g->v[g->stack[top]];
+
+		if (u == g->t) {
+			d = INT32_MAX;
+			for (i = 0; i < top; i += 1) {
+				a = &g->v[g->stack[i]].edge.a[g->cur[g->stack[i]]];
+				d = MIN(d, a->r);
+			}
+
+			for (i = 0; i < top; i += 1) {
+				a = &g->v[g->stack[i]].edge.a[g->cur[g->stack[i]]];
+				a->r -= d;
+				g->v[a->v].edge.a[a->mate].r += d;
+			}
+
+			flow += d;
+
+			for (i = 0; i < top; i += 1) {
+				a = &g->v[g->stack[i]].edge.a[g->cur[g->stack[i]]];
+				if (a->r == 0)
+					break;
+			}
+
+			top = i;
+			continue;
+		}
+
+		while (g->cur[u - g->v] < u->edge.i) {
+			a = &u->edge.a[g->cur[u - g->v]];
+			if (a->r > 0 && g->v[a->v].h == u->h + 1)
+				break;
+			g->cur[u - g->v] += 1;
+		}
+
+		if (g->cur[u - g->v] < u->edge.i) {
+			g->stack[++top] = a->v;
+		} else {
+			u->h = -1;
+			top -= 1;
+			if (top >= 0)
+				g->cur[g->stack[top]] += 1;
+		}
 	}
-	free(g->v);
-	free(g->edge_data);
-	free(g);
+
+	return flow;
+}
+
+static int dinic(graph_t* g)
+{
+	int		f;
+
+	/* Dinic's algorithm: find the shortest paths from s to t
+	 * with a breadth first search and then push as much as
+	 * possible along shortest paths only, and repeat until t
+	 * cannot be reached. each round makes the distance from s to t
+	 * longer so there are at most n rounds.
+	 *
+	 * the excess of s and t is set as by xpreflow so that the
+	 * result looks the same to the caller.
+	 *
+	 */
+
+	f = 0;
+
+	while (levels(g))
+		f += blocking_flow(g);
+
+	g->s->e = -f;
+	g->t->e = f;
+
+	return f;
+}
+
+/* the Boykov-Kolmogorov algorithm keeps two trees of nodes: the S tree
+ * from s, where each node can be reached from its parent through an arc
+ * with residual capacity, and the T tree into t, where each node can
+ * reach its parent. the trees grow from their active nodes until an
+ * arc with residual capacity goes from the S tree to the T tree, and
+ * then we push along the path from s through that arc to t. the arcs
+ * that become saturated cut some nodes from their trees, which are then
+ * orphans, and instead of building the trees again we find each orphan
+ * a new parent in its tree, or make it free if there is none.
+ *
+ * the trees are not built again from s and t after each path, which is
+ * why it is fast when there are many short paths, as in grids.
+ *
+ * parent[v] is the index of the arc of v to its parent. the active nodes
+ * are in a ring in queue with inExcess set, the orphans in stack, and h
+ * is the distance to the root found at time ts, used to pick the parent
+ * nearest the root for an orphan.
+ *
+ */
+
+static void bk_activate(graph_t* g, int v, int* head, int* count)
+{
+	if (!g->v[v].inExcess) {
+		g->v[v].inExcess = 1;
+		g->queue[(*head + *count) % g->n] = v;
+		*count += 1;
+	}
+}
+
+static int bk_valid(graph_t* g, int tree, edge_t* a)
+{
+	/* can a, from a node in tree, be used to go away from the root? */
+
+	if (tree == TREE_S)
+		return a->r > 0;
+	else
+		return g->v[a->v].edge.a[a->mate].r > 0;
+}
+
+static int bk_augment(graph_t* g, int x, edge_t* ax, int* orphans)
+{
+	node_t*		u;
+	edge_t*		a;
+	edge_t*		b;
+	int		d;
+	int		v;
+	int		k;
+
+	/* x is in the S tree and ax goes to a node in the T tree.
+	 * push the smallest residual capacity on the path and make
+	 * orphans of the nodes whose arc to their parent becomes
+	 * saturated. return how much was pushed.
+	 *
+	 */
+
+	d = ax->r;
+
+	for (v = x; g->parent[v] != PARENT_ROOT; v = a->v) {
+		a = &g->v[v].edge.a[g->parent[v]];
+		d = MIN(d, g->v[a->v].edge.a[a->mate].r);
+	}
+
+	for (v = ax->v; g->parent[v] != PARENT_ROOT; v = a->v) {
+		a = &g->v[v].edge.a[g->parent[v]];
+		d = MIN(d, a->r);
+	}
+
+	ax->r -= d;
+	g->v[ax->v].edge.a[ax->mate].r += d;
+	k = *orphans;
+
+	for (v = x; g->parent[v] != PARENT_ROOT; v = a->v) {
+		u = &g->v[v];
+		a = &u->edge.a[g->parent[v]];
+		b = &g->v[a->v].edge.a[a->mate];
+		b->r -= d;
+		a->r += d;
+		if (b->r == 0) {
+			g->parent[v] = PARENT_NONE;
+			g->stack[k++] = v;
+		}
+	}
+
+	for (v = ax->v; g->parent[v] != PARENT_ROOT; v = a->v) {
+		u = &g->v[v];
+		a = &u->edge.a[g->parent[v]];
+		a->r -= d;
+		g->v[a->v].edge.a[a->mate].r += d;
+		if (a->r == 0) {
+			g->parent[v] = PARENT_NONE;
+			g->stack[k++] = v;
+		}
+	}
+
+	*orphans = k;
+
+	return d;
+}
+
+static void bk_adopt(graph_t* g, int v, int time, int* orphans, int* head, int* count)
+{
+	node_t*		u;
+	edge_t*		a;
+	int		tree;
+	int		best;
+	int		dmin;
+	int		d;
+	int		j;
+	int		w;
+
+	/* find the orphan v a new parent in its tree: a neighbour
+	 * through a valid arc whose path to the root has no orphan.
+	 * we follow the parents to see that, and mark the nodes on
+	 * the way with time and their distance so that later walks
+	 * can stop there. of the candidates we take the one nearest
+	 * the root.
+	 *
+	 * if there is none, v becomes free, its neighbours in the
+	 * tree that could grow into v again become active, and its
+	 * children become orphans.
+	 *
+	 */
+
+	u = &g->v[v];
+	tree = g->tree[v];
+	best = PARENT_NONE;
+	dmin = INT32_MAX;
+
+	for (j = 0; j < u->edge.i; j += 1) {
+		a = &u->edge.a[j];
+		w = a->v;
+
+		if (g->tree[w] != tree)
+			continue;
+
+		/* the arc from w to v is the mate of a. */
+
+		if (!bk_valid(g, tree, &g->v[w].edge.a[a->mate]))
+			continue;
+
+		for (d = 0;; d += 1) {
+			if (g->ts[w] == time) {
+				d += g->v[w].h;
+				break;
+			}
+			if (g->parent[w] == PARENT_ROOT) {
+				g->ts[w] = time;
+				g->v[w].h = 0;
+				break;
+			}
+			if (g->parent[w] == PARENT_NONE) {
+				d = INT32_MAX;
+				break;
+			}
+			w = g->v[w].edge.a[g->parent[w]].v;
+		}
+
+		if (d == INT32_MAX)
+			continue;
+
+		if (d < dmin) {
+			dmin = d;
+			best = j;
+		}
+
+		for (w = a->v; g->ts[w] != time; w = g->v[w].edge.a[g->parent[w]].v) {
+			g->ts[w] = time;
+			g->v[w].h = d--;
+		}
+	}
+
+	if (best != PARENT_NONE) {
+		g->parent[v] = best;
+		g->ts[v] = time;
+		u->h = dmin + 1;
+		return;
+	}
+
+	g->tree[v] = TREE_FREE;
+
+	for (j = 0; j < u->edge.i; j += 1) {
+		a = &u->edge.a[j];
+		w = a->v;
+
+		if (g->tree[w] != tree)
+			continue;
+
+		if (bk_valid(g, tree, &g->v[w].edge.a[a->mate]))
+			bk_activate(g, w, head, count);
+
+		if (g->parent[w] >= 0 && g->v[w].edge.a[g->parent[w]].v == v) {
+			g->parent[w] = PARENT_NONE;
+			g->stack[(*orphans)++] = w;
+		}
+	}
+}
+
+static int bk(graph_t* g)
+{
+	node_t*		u;
+	edge_t*		a;
+	int		orphans;
+	int		count;
+	int		head;
+	int		time;
+	int		f;
+	int		i;
+	int		j;
+	int		p;
+	int		q;
+	int		s;
+	int		t;
+
+	s = g->s - g->v;
+	t = g->t - g->v;
+
+	for (i = 0; i < g->n; i += 1) {
+		g->tree[i] = TREE_FREE;
+		g->parent[i] = PARENT_NONE;
+		g->ts[i] = -1;
+		g->v[i].h = 0;
+		g->v[i].inExcess = 0;
+	}
+
+	head = count = 0;
+	time = 0;
+	f = 0;
+
+	g->tree[s] = TREE_S;
+	g->tree[t] = TREE_T;
+	g->parent[s] = g->parent[t] = PARENT_ROOT;
+	g->ts[s] = g->ts[t] = time;
+	bk_activate(g, s, &head, &count);
+	bk_activate(g, t, &head, &count);
+
+	while (count > 0) {
+		p = g->queue[head];
+		head = (head + 1) % g->n;
+		count -= 1;
+		u = &g->v[p];
+		u->inExcess = 0;
+
+		if (g->tree[p] == TREE_FREE)
+			continue;
+
+		/* grow the tree of p through its valid arcs. */
+
+		a = NULL;
+		q = p;
+
+		for (j = 0; j < u->edge.i; j += 1) {
+			a = &u->edge.a[j];
+			q = a->v;
+
+			if (!bk_valid(g, g->tree[p], a))
+				continue;
+
+			if (g->tree[q] == TREE_FREE) {
+				g->tree[q] = g->tree[p];
+				g->parent[q] = a->mate;
+				g->ts[q] = g->ts[p];
+				g->v[q].h = u->h + 1;
+				bk_activate(g, q, &head, &count);
+			} else if (g->tree[q] != g->tree[p])
+				break;
+		}
+
+		if (j == u->edge.i)
+			continue;
+
+		/* found a path, push along it and adopt the orphans.
+		 * p may have more arcs to look at so it stays active.
+		 *
+		 */
+
+		orphans = 0;
+
+		if (g->tree[p] == TREE_S)
+			f += bk_augment(g, p, a, &orphans);
+		else
+			f += bk_augment(g, q, &g->v[q].edge.a[a->mate], &orphans);
+
+		time += 1;
+
+		while (orphans > 0) {
+			orphans -= 1;
+			bk_adopt(g, g->stack[orphans], time, &orphans, &head, &count);
+		}
+
+		if (g->tree[p] != TREE_FREE)
+			bk_activate(g, p, &head, &count);
+	}
+
+	g->s->e = -f;
+	g->t->e = f;
+
+	return f;
+}
+
+int solve(graph_t* g, int s, int t, int engine)
+{
+	/* find the maximum flow from s to t with one of
+	 *
+	 *	ENGINE_PREFLOW	push-relabel with nThreads threads.
+	 *	ENGINE_DINIC	Dinic's blocking flows, sequential.
+	 *	ENGINE_BK	Boykov-Kolmogorov, sequential.
+	 *
+	 * the residual capacities are used up by a solve so each
+	 * graph can be solved once. either way preflow_cut can be
+	 * used afterwards.
+	 *
+	 */
+
+	if (s < 0 || s >= g->n || t < 0 || t >= g->n || s == t)
+		error("bad source %d or sink %d for %d nodes", s, t, g->n);
+
+	g->s = &g->v[s];
+	g->t = &g->v[t];
+
+	switch (engine) {
+	case ENGINE_PREFLOW:
+		return xpreflow(g, g->nThreads);
+
+	case ENGINE_DINIC:
+		return dinic(g);
+
+	case ENGINE_BK:
+		return bk(g);
+
+	default:
+		error("unknown engine %d", engine);
+		return 0;
+	}
+}
+
+int preflow_solve(graph_t* g, int s, int t)
+{
+	return solve(g, s, t, ENGINE_PREFLOW);
+}
+
+int preflow_cut(graph_t* g, char* side, xedge_t** cut)
+{
+	node_t*		u;
+	node_t*		w;
+	edge_t*		a;
+	int		i;
+	int		j;
+	int		k;
+
+	/* after preflow_solve, with or without phase 2, the nodes
+	 * that cannot reach t through arcs with residual capacity are
+	 * the source side of a minimum cut. the others are found with
+	 * a breadth first search backwards from t. side[i] is set to
+	 * 1 for the source side and 0 for the sink side, so side must
+	 * have room for n chars.
+	 *
+	 * the edges from the source side to the sink side are put in
+	 * *cut, which the caller frees, with u on the source side, and
+	 * we return how many there are. their capacities add up to the
+	 * maximum flow. a push moves capacity from one arc of an edge
+	 * to the other so the capacity is half the sum of the two.
+	 *
+	 */
+
+	memset(side, 1, g->n);
+
+	side[g->t - g->v] = 0;
+	g->queue[0] = g->t - g->v;
+	k = 1;
+
+	for (i = 0; i < k; i += 1) {
+		u = &g->v[g->queue[i]];
+		for (j = 0; j < u->edge.i; j += 1) {
+			a = &u->edge.a[j];
+			w = &g->v[a->v];
+			if (side[a->v] && w->edge.a[a->mate].r > 0) {
+				side[a->v] = 0;
+				g->queue[k++] = a->v;
+			}
+		}
+	}
+
+	k = 0;
+	for (i = 0; i < g->n; i += 1)
+		for (j = 0; side[i] && j < g->v[i].edge.i; j += 1)
+			k += !side[g->v[i].edge.a[j].v];
+
+	*cut = xmalloc(k * sizeof(xedge_t));
+
+	k = 0;
+	for (i = 0; i < g->n; i += 1) {
+		u = &g->v[i];
+		for (j = 0; side[i] && j < u->edge.i; j += 1) {
+			a = &u->edge.a[j];
+			if (!side[a->v]) {
+				(*cut)[k].u = i;
+				(*cut)[k].v = a->v;
+				(*cut)[k].c = (a->r + g->v[a->v].edge.a[a->mate].r) / 2;
+				k += 1;
+			}
+		}
+	}
+
+	return k;
 }
 
 #ifndef MAIN
 int preflow(int n, int m, int s, int t, xedge_t* e)
 {
+	builder_t*	b;
 	graph_t*	g;
 	int		f;
-	int nThreads = 4;
+	int nThreads = thread_count();
 
-	g = new_graph(n, m, s, t, e, nThreads);
-	f = xpreflow(g, nThreads);
-	free_graph(g, n, nThreads);
+	b = preflow_builder(n, m);
+	preflow_add_edges(b, e, m);
+	g = preflow_finalize(b, nThreads);
+	f = preflow_solve(g, s, t);
+	preflow_free(g);
 	return f;
 }
 #endif
 
 #ifdef MAIN
+static void print_cut(graph_t* g, int f)
+{
+	xedge_t*	cut;
+	char*		side;
+	int		sum;
+	int		i;
+	int		k;
+
+	/* print the source side and the edges of a minimum cut:
+	 *
+	 *	side = number of nodes on the source side
+	 *	one node per line
+	 *	cut = number of edges in the cut
+	 *	u v c per line, where u is on the source side
+	 *
+	 */
+
+	side = xmalloc(g->n);
+	k = preflow_cut(g, side, &cut);
+
+	for (i = sum = 0; i < g->n; i += 1)
+		sum += side[i];
+
+	printf("side = %d\n", sum);
+
+	for (i = 0; i < g->n; i += 1)
+		if (side[i])
+			printf("%d\n", i);
+
+	printf("cut = %d\n", k);
+
+	for (i = sum = 0; i < k; i += 1) {
+		printf("%d %d %d\n", cut[i].u, cut[i].v, cut[i].c);
+		sum += cut[i].c;
+	}
+
+	if (sum != f)
+		error("cut has capacity %d but the flow is %d", sum, f);
+
+	free(cut);
+	free(side);
+}
+
 int main(int argc, char* argv[])
 {
 	FILE*		in;	/* input file set to stdin	*/
@@ -777,12 +1900,57 @@ int main(int argc, char* argv[])
 	int		f;	/* output from preflow.		*/
 	int		n;	/* number of nodes.		*/
 	int		m;	/* number of edges.		*/
-	int	 nThreads = 4;
+	int	 nThreads = thread_count();
+	double		alpha;	/* how often to global_relabel.	*/
+	int		phases;	/* 2 to make a flow of the preflow.	*/
+	int		cut;	/* print a minimum cut too.	*/
+	int		engine;	/* how to find the flow.	*/
+	int		schedule;	/* how to divide the work list.	*/
+	int		stats;	/* print load imbalance.	*/
+	int		c;
 
 	progname = argv[0];	/* name is a string in argv[0]. */
 
+	alpha = 6;
+	phases = 1;
+	cut = 0;
+	engine = ENGINE_PREFLOW;
+	schedule = SCHEDULE_DYNAMIC;
+	stats = 0;
+
+	while ((c = getopt(argc, argv, "ce:fg:t:vw:")) != -1) {
+		if (c == 'e' && strcmp(optarg, "preflow") == 0)
+			engine = ENGINE_PREFLOW;
+		else if (c == 'e' && strcmp(optarg, "dinic") == 0)
+			engine = ENGINE_DINIC;
+		else if (c == 'e' && strcmp(optarg, "bk") == 0)
+			engine = ENGINE_BK;
+		else if (c == 'w' && strcmp(optarg, "static") == 0)
+			schedule = SCHEDULE_STATIC;
+		else if (c == 'w' && strcmp(optarg, "dynamic") == 0)
+			schedule = SCHEDULE_DYNAMIC;
+		else if (c == 'w' && strcmp(optarg, "degree") == 0)
+			schedule = SCHEDULE_DEGREE;
+		else if (c == 'v')
+			stats = 1;
+		else if (c == 't' && (nThreads = atoi(optarg)) > 0)
+			;
+		else if (c == 'g' && (alpha = atof(optarg)) >= 0)
+			;
+		else if (c == 'f')
+			phases = 2;
+		else if (c == 'c')
+			cut = 1;
+		else
+			error("usage: %s [-c] [-e preflow|dinic|bk] [-f] [-g alpha] [-t threads] [-v] [-w static|dynamic|degree] < graph", progname);
+	}
+
 	in = stdin;		/* same as System.in in Java.	*/
 
+#if MMAP_INPUT
+	open_input(&input, fileno(in));
+#endif
+
 	n = next_int();
 	m = next_int();
 
@@ -792,13 +1960,24 @@ int main(int argc, char* argv[])
 
 	g = new_graph(in, n, m, nThreads);
 
+#if MMAP_INPUT
+	close_input(&input);
+#endif
+
 	fclose(in);
 
-	f = xpreflow(g, nThreads);
+	g->alpha = alpha;
+	g->phases = phases;
+	g->schedule = schedule;
+	g->stats = stats;
+	f = solve(g, 0, n - 1, engine);
 
 	printf("f = %d\n", f);
 
-	free_graph(g, n, nThreads);
+	if (cut)
+		print_cut(g, f);
+
+	preflow_free(g);
 
 	return 0;
 }
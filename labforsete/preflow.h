@@ -0,0 +1,50 @@
+#ifndef PREFLOW_H
+#define PREFLOW_H
+
+/* the maximum flow library in preflow.c.
+ *
+ * a graph is made in three steps with a builder:
+ *
+ *	b = preflow_builder(n, m);
+ *	preflow_add_edges(b, e, k);	as many times as needed
+ *	g = preflow_finalize(b, nThreads);
+ *
+ * then solve(g, s, t, engine) or preflow_solve(g, s, t) finds the
+ * maximum flow from s to t, preflow_cut(g, side, &cut) gives a minimum
+ * cut, and preflow_free(g) frees everything.
+ *
+ * preflow(n, m, s, t, e) does all of it for an array of m edges and
+ * returns the flow. it is not in the stand-alone program (with MAIN).
+ *
+ * errors such as a negative capacity print a message and exit.
+ *
+ */
+
+#include <stdint.h>
+
+typedef struct graph_t	graph_t;
+typedef struct builder_t	builder_t;
+typedef struct xedge_t	xedge_t;
+
+enum {
+	ENGINE_PREFLOW,		/* see solve.			*/
+	ENGINE_DINIC,
+	ENGINE_BK,
+};
+
+struct xedge_t {
+	int32_t		u;	/* one of the two nodes.	*/
+	int32_t		v;	/* the other. 			*/
+	int32_t		c;	/* capacity.			*/
+};
+
+builder_t* preflow_builder(int n, int m);
+void preflow_add_edges(builder_t* b, const xedge_t* e, int k);
+graph_t* preflow_finalize(builder_t* b, int nThreads);
+int solve(graph_t* g, int s, int t, int engine);
+int preflow_solve(graph_t* g, int s, int t);
+int preflow_cut(graph_t* g, char* side, xedge_t** cut);
+void preflow_free(graph_t* g);
+int preflow(int n, int m, int s, int t, xedge_t* e);
+
+#endif /* PREFLOW_H */